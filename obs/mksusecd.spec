@@ -34,8 +34,12 @@ BuildRequires:  asciidoc
 BuildRequires:  libxslt-tools
 %endif
 %endif
+BuildRequires:  perl
 BuildRequires:  pkgconfig(blkid)
 BuildRequires:  pkgconfig(json-c)
+BuildRequires:  pkgconfig(libcurl)
+BuildRequires:  pkgconfig(liblzma)
+BuildRequires:  pkgconfig(libzstd)
 BuildRequires:  pkgconfig(uuid)
 %if %suse_version >= 1500
 Requires:       createrepo-implementation
@@ -55,6 +59,7 @@ Requires:       gpg2
 Requires:       gzip
 Requires:       kmod
 Requires:       mtools
+Requires:       perl(:MODULE_COMPAT_%(eval "`%{__perl} -V:version`"; echo $version))
 Requires:       perl-JSON
 Requires:       rpm
 Requires:       squashfs
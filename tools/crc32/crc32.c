@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "crc32.h"
+
+/*
+ * All implementations work on the plain shift register value; the
+ * pre- and post-inversion is done in crc32_update().
+ */
+
+#define CRC32_POLY	0xedb88320
+
+static uint32_t crc32_table[8][256];
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len);
+static uint32_t (*crc32_func)(uint32_t crc, const uint8_t *buf, size_t len) = crc32_slice8;
+static const char *crc32_name = "slice-by-8";
+
+static void crc32_init(void) __attribute__((constructor));
+
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+  return ~crc32_func(~crc, buf, len);
+}
+
+
+const char *crc32_implementation()
+{
+  return crc32_name;
+}
+
+
+/*
+ * Byte order independent 32 bit little-endian load.
+ */
+static inline uint32_t crc32_load_le(const uint8_t *buf)
+{
+  return buf[0] + (buf[1] << 8) + (buf[2] << 16) + ((uint32_t) buf[3] << 24);
+}
+
+
+/*
+ * Table lookup, 8 bytes at a time.
+ */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  for(; len >= 8; len -= 8, buf += 8) {
+    uint32_t lo = crc32_load_le(buf) ^ crc;
+    uint32_t hi = crc32_load_le(buf + 4);
+
+    crc =
+      crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+      crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+      crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+      crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+  }
+
+  while(len--) crc = crc32_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+
+#if defined(__x86_64__)
+
+/*
+ * Carry-less multiplication folding, see Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The constants are for
+ * the bit-reflected CRC-32 polynomial.
+ *
+ * Processes len bytes; len must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((__m128i *) (buf + 0x00));
+  x2 = _mm_loadu_si128((__m128i *) (buf + 0x10));
+  x3 = _mm_loadu_si128((__m128i *) (buf + 0x20));
+  x4 = _mm_loadu_si128((__m128i *) (buf + 0x30));
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+  buf += 64;
+  len -= 64;
+
+  // fold 4 x 128 bits in parallel
+  for(; len >= 64; len -= 64, buf += 64) {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i *) (buf + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i *) (buf + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i *) (buf + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i *) (buf + 0x30)));
+  }
+
+  // fold into 128 bits
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // remaining 16 byte blocks
+  for(; len >= 16; len -= 16, buf += 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i *) buf)), x5);
+  }
+
+  // fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return _mm_extract_epi32(x1, 1);
+}
+
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  if(len >= 64) {
+    size_t n = len & ~(size_t) 15;
+
+    crc = crc32_pclmul_fold(crc, buf, n);
+    buf += n;
+    len -= n;
+  }
+
+  return crc32_slice8(crc, buf, len);
+}
+
+#endif
+
+
+#if defined(__aarch64__)
+
+/*
+ * ARMv8 CRC32 instructions.
+ */
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  for(; len && ((uintptr_t) buf & 7); len--) crc = __crc32b(crc, *buf++);
+
+  for(; len >= 8; len -= 8, buf += 8) crc = __crc32d(crc, *(const uint64_t *) buf);
+
+  while(len--) crc = __crc32b(crc, *buf++);
+
+  return crc;
+}
+
+#endif
+
+
+/*
+ * Set up lookup tables and pick implementation.
+ */
+static void crc32_init()
+{
+  for(unsigned u = 0; u < 256; u++) {
+    uint32_t crc = u;
+    for(unsigned i = 0; i < 8; i++) crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLY : 0);
+    crc32_table[0][u] = crc;
+  }
+
+  for(unsigned u = 0; u < 256; u++) {
+    for(unsigned i = 1; i < 8; i++) {
+      crc32_table[i][u] = (crc32_table[i - 1][u] >> 8) ^ crc32_table[0][crc32_table[i - 1][u] & 0xff];
+    }
+  }
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    crc32_func = crc32_pclmul;
+    crc32_name = "pclmul";
+  }
+#endif
+
+#if defined(__aarch64__)
+  if(getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    crc32_func = crc32_armv8;
+    crc32_name = "armv8-crc";
+  }
+#endif
+}
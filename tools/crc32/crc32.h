@@ -0,0 +1,13 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-32 (ISO 3309, as used by GPT, zlib, gzip).
+ *
+ * crc is the result for the preceding data (0 to start). The fastest
+ * implementation available on the CPU is chosen at startup.
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+// name of the implementation in use
+const char *crc32_implementation(void);
@@ -0,0 +1,83 @@
+/*
+ * CRC-32 throughput benchmark.
+ *
+ * crc32.c is included directly to time every implementation compiled in
+ * for this architecture.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.c"
+
+typedef uint32_t (*crc32_func_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+// GPT header, GPT partition array, large block
+static size_t sizes[] = { 92, 16 << 10, 1 << 20 };
+
+static double now(void);
+static void bench(const char *name, crc32_func_t func, const uint8_t *buf);
+
+
+int main()
+{
+  size_t size = 1 << 20;
+  uint8_t *buf = malloc(size);
+
+  if(!buf) {
+    perror("malloc");
+    return 1;
+  }
+
+  for(size_t i = 0; i < size; i++) buf[i] = i * 7 + (i >> 8);
+
+  printf("default: %s\n", crc32_implementation());
+
+  bench("slice-by-8", crc32_slice8, buf);
+
+#if defined(__x86_64__)
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    bench("pclmul", crc32_pclmul, buf);
+  }
+#endif
+
+#if defined(__aarch64__)
+  if(getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    bench("armv8-crc", crc32_armv8, buf);
+  }
+#endif
+
+  free(buf);
+
+  return 0;
+}
+
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Checksum about 1 GiB per buffer size and report MB/s.
+ */
+void bench(const char *name, crc32_func_t func, const uint8_t *buf)
+{
+  for(size_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    size_t rounds = (1 << 30) / sizes[i];
+    volatile uint32_t crc = 0;
+    double t = now();
+
+    for(size_t j = 0; j < rounds; j++) crc = func(crc, buf, sizes[i]);
+
+    t = now() - t;
+
+    printf("%-10s %8zu bytes: %8.0f MB/s\n", name, sizes[i], rounds * sizes[i] / t / 1e6);
+  }
+}
@@ -0,0 +1,156 @@
+/*
+ * CRC-32 unit test.
+ *
+ * crc32.c is included directly so every implementation compiled in for
+ * this architecture can be checked, not only the one picked at startup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.c"
+
+typedef uint32_t (*crc32_func_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static struct {
+  size_t len;
+  const char *data;
+  uint32_t crc;
+} vectors[] = {
+  {  0, "", 0 },
+  {  1, "a", 0xe8b7be43 },
+  {  3, "abc", 0x352441c2 },
+  {  9, "123456789", 0xcbf43926 },
+  { 43, "The quick brown fox jumps over the lazy dog", 0x414fa339 },
+};
+
+static unsigned errors;
+
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t *buf, size_t len);
+static uint32_t crc32_with(crc32_func_t func, uint32_t crc, const uint8_t *buf, size_t len);
+static void check(const char *name, const char *what, size_t len, uint32_t crc, uint32_t ref);
+static void test(const char *name, crc32_func_t func);
+
+
+int main()
+{
+  test("slice-by-8", crc32_slice8);
+
+#if defined(__x86_64__)
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    test("pclmul", crc32_pclmul);
+  }
+  else {
+    printf("pclmul: skipped (not supported by CPU)\n");
+  }
+#endif
+
+#if defined(__aarch64__)
+  if(getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    test("armv8-crc", crc32_armv8);
+  }
+  else {
+    printf("armv8-crc: skipped (not supported by CPU)\n");
+  }
+#endif
+
+  // the public interface, whatever it dispatches to
+  printf("crc32_update: using %s\n", crc32_implementation());
+  test("crc32_update", NULL);
+
+  return errors ? 1 : 0;
+}
+
+
+/*
+ * Reference implementation, one bit at a time.
+ */
+uint32_t crc32_bitwise(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  crc = ~crc;
+
+  while(len--) {
+    crc ^= *buf++;
+    for(unsigned i = 0; i < 8; i++) crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLY : 0);
+  }
+
+  return ~crc;
+}
+
+
+/*
+ * Run a single implementation; NULL means crc32_update().
+ */
+uint32_t crc32_with(crc32_func_t func, uint32_t crc, const uint8_t *buf, size_t len)
+{
+  return func ? ~func(~crc, buf, len) : crc32_update(crc, buf, len);
+}
+
+
+void check(const char *name, const char *what, size_t len, uint32_t crc, uint32_t ref)
+{
+  if(crc == ref) return;
+
+  printf("%s: %s, len %zu: got 0x%08x, expected 0x%08x\n", name, what, len, crc, ref);
+
+  errors++;
+}
+
+
+/*
+ * Check known vectors, all lengths and alignments up to a few folding
+ * blocks, incremental updates, and large buffers.
+ */
+void test(const char *name, crc32_func_t func)
+{
+  unsigned old_errors = errors;
+  size_t size = 1 << 20;
+  uint8_t *buf = malloc(size + 16);
+  uint32_t seed = 1;
+
+  if(!buf) {
+    perror("malloc");
+    exit(1);
+  }
+
+  for(size_t i = 0; i < size + 16; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+
+  for(size_t i = 0; i < sizeof vectors / sizeof *vectors; i++) {
+    check(name, "vector", vectors[i].len, crc32_with(func, 0, (const uint8_t *) vectors[i].data, vectors[i].len), vectors[i].crc);
+  }
+
+  {
+    uint8_t tmp[4096];
+
+    memset(tmp, 0, sizeof tmp);
+    check(name, "zeros", sizeof tmp, crc32_with(func, 0, tmp, sizeof tmp), 0xc71c0011);
+
+    memset(tmp, 0xff, 1000);
+    check(name, "0xff", 1000, crc32_with(func, 0, tmp, 1000), 0xe0533230);
+
+    for(unsigned i = 0; i < 1024; i++) tmp[i] = i;
+    check(name, "0..255", 1024, crc32_with(func, 0, tmp, 1024), 0xb70b4c26);
+  }
+
+  for(size_t ofs = 0; ofs < 16; ofs++) {
+    for(size_t len = 0; len <= 512; len++) {
+      check(name, "random", len, crc32_with(func, 0, buf + ofs, len), crc32_bitwise(0, buf + ofs, len));
+    }
+  }
+
+  for(size_t split = 0; split <= 300; split++) {
+    uint32_t crc = crc32_with(func, 0, buf, split);
+    crc = crc32_with(func, crc, buf + split, 300 - split);
+    check(name, "split", split, crc, crc32_bitwise(0, buf, 300));
+  }
+
+  check(name, "large", size, crc32_with(func, 0, buf + 3, size), crc32_bitwise(0, buf + 3, size));
+
+  free(buf);
+
+  printf("%s: %s\n", name, errors == old_errors ? "ok" : "FAILED");
+}
@@ -23,7 +23,10 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <err.h>
+#include <errno.h>
 #include <time.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -34,11 +37,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <inttypes.h>
 #include <uuid/uuid.h>
 
 #include "isohybrid.h"
+#include "../crc32/crc32.h"
 
 char *prog = NULL;
 extern int opterr, optind;
@@ -72,14 +79,55 @@ uint32_t c = 0;
 off_t iso_size = 0;
 off_t iso_filesize = 0;
 
+enum { SYNC_NONE, SYNC_DATA, SYNC_FULL };
+
 struct {
   unsigned no_mbr:1;		/* gpt: don't write protective mbr */
   unsigned no_code:1;		/* no mbr boot code */
   unsigned no_chs:1;		/* fill in 0xffffff instead of real chs values */
+  unsigned sync:2;		/* SYNC_* */
+  unsigned stream:1;		/* read image from stdin, write to stdout */
+  char *batch;			/* manifest file for batch mode */
+  unsigned jobs;		/* batch mode: max. images processed in parallel */
+  char *seed;			/* derive GUIDs and MBR id from seed + image name */
   off_t size;			/* total size MBR partition table should cover */
   char *mbr_file;		/* read mbr from file (432 bytes) */
 } opt;
 
+/* image file */
+int iso_fd = -1;
+char *iso_name = NULL;
+
+/* stream mode: start of image as read from stdin so far */
+struct {
+    uint8_t *buf;
+    size_t len;
+    int out_fd;
+} stream;
+
+/*
+ * Batch mode: result for a single image; filled in by the child process
+ * handling the image, in memory shared with the parent.
+ */
+struct batch_result {
+    int done;
+    int gpt;
+    uint32_t id;
+    uuid_t disk_uuid;
+    off_t size;
+} *result;
+
+/*
+ * Parts of the image to be (re-)written; everything is prepared in memory
+ * first and then written in one go by write_regions().
+ */
+struct region {
+    off_t ofs;
+    size_t len;
+    void *buf;
+} regions[4];
+unsigned regions_used = 0;
+
 
 /* boot catalogue parameters */
 uint32_t de_lba = 0;
@@ -97,74 +145,6 @@ uuid_t efi_system_partition = {0xC1, 0x2A, 0x73, 0x28, 0xF8, 0x1F, 0x11, 0xD2, 0
 uuid_t basic_partition = {0xEB,0xD0,0xA0,0xA2,0xB9,0xE5,0x44,0x33,0x87,0xC0,0x68,0xB6,0xB7,0x26,0x99,0xC7};
 uuid_t hfs_partition = {0x48, 0x46, 0x53, 0x00, 0x00, 0x00, 0x11, 0xAA, 0xAA, 0x11, 0x00, 0x30, 0x65, 0x43, 0xEC, 0xAC};
 
-uint32_t crc_tab[256] =
-{
-    0, 0x77073096, 0xEE0E612C, 0x990951BA,
-    0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-    0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
-    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-    0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
-    0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-    0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
-    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-    0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
-    0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
-    0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
-    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
-    0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
-    0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-    0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-    0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
-    0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
-    0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-    0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
-    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
-    0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
-    0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
-    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-    0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
-    0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
-    0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-    0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
-    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-    0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
-    0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
-    0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-    0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
-    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
-    0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
-    0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-    0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
-    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-    0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
-    0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
-    0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
-    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-    0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
-    0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
-    0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-};
-
 struct iso_primary_descriptor {
     uint8_t ignore [80];
     uint32_t size;
@@ -229,6 +209,8 @@ void
 usage(void)
 {
     printf("Usage: %s [OPTIONS] <boot.iso>\n", prog);
+    printf("       %s [OPTIONS] --stream < boot.iso > boot.img\n", prog);
+    printf("       %s [OPTIONS] --batch FILE\n", prog);
 }
 
 
@@ -259,6 +241,12 @@ printh(void)
     printf(FMT, "   --no-legacy", "Do not expect an El Torito boot record");
     printf(FMT, "   --mbr-file FILE", "Use MBR from FILE");
     printf(FMT, "   --grub", "GRUB mode");
+    printf(FMT, "   --sync MODE", "Flush image to disk when done: none (default), data, full");
+    printf(FMT, "   --stream", "Read image from stdin and write hybrid image to stdout");
+    printf(FMT, "   --batch FILE", "Process all images listed in FILE, one per line, with optional extra options");
+    printf(FMT, "", "(separated by white space, so image names can't contain spaces)");
+    printf(FMT, "   --jobs N", "Batch mode: process up to N images in parallel (default: number of CPUs)");
+    printf(FMT, "   --seed STRING", "Derive GUIDs and MBR id from STRING and image name instead of random values");
 
     printf("\n");
     printf(FMT, "   --forcehd0", "Assume we are loaded as disk ID 0");
@@ -275,43 +263,49 @@ printh(void)
 }
 
 
-int
-check_option(int argc, char *argv[])
+static const char optstr[] = ":h:s:e:o:t:i:fcp?vV";
+static struct option lopt[] = \
 {
-    char *err = NULL;
-    int n = 0, ind = 0;
-
-    const char optstr[] = ":h:s:e:o:t:i:fcp?vV";
-    struct option lopt[] = \
-    {
-        { "entry", required_argument, NULL, 'e' },
-        { "offset", required_argument, NULL, 'o' },
-        { "size", required_argument, NULL, 1006 },
-        { "type", required_argument, NULL, 't' },
-        { "id", required_argument, NULL, 'i' },
-        { "mbr-file", required_argument, NULL, 1009 },
-        { "gpt", no_argument, NULL, 1001 },
-        { "mbr", no_argument, NULL, 1002 },
-        { "no-mbr", no_argument, NULL, 1003 },
-        { "no-code", no_argument, NULL, 1004 },
-        { "no-chs", no_argument, NULL, 1005 },
-        { "legacy", no_argument, NULL, 1007 },
-        { "no-legacy", no_argument, NULL, 1008 },
-        { "mbr-file", required_argument, NULL, 1009 },
-        { "grub", no_argument, NULL, 1010 },
-
-        { "forcehd0", no_argument, NULL, 'f' },
-        { "ctrlhd0", no_argument, NULL, 'c' },
-        { "partok", no_argument, NULL, 'p'},
+    { "entry", required_argument, NULL, 'e' },
+    { "offset", required_argument, NULL, 'o' },
+    { "size", required_argument, NULL, 1006 },
+    { "type", required_argument, NULL, 't' },
+    { "id", required_argument, NULL, 'i' },
+    { "mbr-file", required_argument, NULL, 1009 },
+    { "gpt", no_argument, NULL, 1001 },
+    { "mbr", no_argument, NULL, 1002 },
+    { "no-mbr", no_argument, NULL, 1003 },
+    { "no-code", no_argument, NULL, 1004 },
+    { "no-chs", no_argument, NULL, 1005 },
+    { "legacy", no_argument, NULL, 1007 },
+    { "no-legacy", no_argument, NULL, 1008 },
+    { "mbr-file", required_argument, NULL, 1009 },
+    { "grub", no_argument, NULL, 1010 },
+    { "sync", required_argument, NULL, 1011 },
+    { "stream", no_argument, NULL, 1012 },
+    { "batch", required_argument, NULL, 1013 },
+    { "jobs", required_argument, NULL, 1014 },
+    { "seed", required_argument, NULL, 1015 },
+
+    { "forcehd0", no_argument, NULL, 'f' },
+    { "ctrlhd0", no_argument, NULL, 'c' },
+    { "partok", no_argument, NULL, 'p'},
 	{ "uefi", no_argument, NULL, 'u'},
 	{ "mac", no_argument, NULL, 'm'},
 
-        { "help", no_argument, NULL, '?' },
-        { "verbose", no_argument, NULL, 'v' },
-        { "version", no_argument, NULL, 'V' },
+    { "help", no_argument, NULL, '?' },
+    { "verbose", no_argument, NULL, 'v' },
+    { "version", no_argument, NULL, 'V' },
+
+    { 0, 0, 0, 0 }
+};
 
-        { 0, 0, 0, 0 }
-    };
+
+int
+check_option(int argc, char *argv[])
+{
+    char *err = NULL;
+    int n = 0, ind = 0;
 
     opterr = 0;
     mode = LEGACY;
@@ -421,6 +415,35 @@ check_option(int argc, char *argv[])
             mode |= GRUB;
             break;
 
+        case 1011:
+            if (!strcmp(optarg, "none"))
+                opt.sync = SYNC_NONE;
+            else if (!strcmp(optarg, "data"))
+                opt.sync = SYNC_DATA;
+            else if (!strcmp(optarg, "full"))
+                opt.sync = SYNC_FULL;
+            else
+                errx(1, "invalid sync mode: `%s', use none, data, or full", optarg);
+            break;
+
+        case 1012:
+            opt.stream = 1;
+            break;
+
+        case 1013:
+            opt.batch = optarg;
+            break;
+
+        case 1014:
+            opt.jobs = strtoul(optarg, &err, 0);
+            if (*err || !opt.jobs)
+                errx(1, "invalid jobs: `%s'", optarg);
+            break;
+
+        case 1015:
+            opt.seed = optarg;
+            break;
+
         case 'V':
             printf("%s version %s\n", prog, VERSION);
             exit(0);
@@ -828,19 +851,6 @@ display_mbr(const uint8_t *mbr, size_t len)
 }
 
 
-uint32_t chksum_crc32 (unsigned char *block, unsigned int length)
-{
-	register unsigned long crc;
-	unsigned long i;
-
-	crc = 0xFFFFFFFF;
-	for (i = 0; i < length; i++)
-	{
-		crc = ((crc >> 8) & 0x00FFFFFF) ^ crc_tab[(crc ^ *block++) & 0xFF];
-	}
-	return (crc ^ 0xFFFFFFFF);
-}
-
 void
 reverse_uuid(uuid_t uuid)
 {
@@ -852,6 +862,35 @@ reverse_uuid(uuid_t uuid)
 	t = p[6]; p[6] = p[7]; p[7] = t;
 }
 
+/*
+ * Get a new GUID for the disk or a partition ('what').
+ *
+ * With --seed, it is derived from seed, image name (exactly as given, so
+ * images with the same file name in different directories differ), and
+ * 'what'; else it's random.
+ */
+void
+new_uuid(uuid_t uuid, const char *what)
+{
+    static uuid_t seed_ns;
+    char *name;
+
+    if (!opt.seed) {
+        uuid_generate(uuid);
+        return;
+    }
+
+    if (uuid_is_null(seed_ns))
+        uuid_generate_sha1(seed_ns, seed_ns, opt.seed, strlen(opt.seed));
+
+    if (asprintf(&name, "%s:%s", iso_name, what) == -1)
+        err(1, NULL);
+
+    uuid_generate_sha1(uuid, seed_ns, name, strlen(name));
+
+    free(name);
+}
+
 void
 set_gpt_part_name(struct gpt_part_header *part, const char *name)
 {
@@ -882,7 +921,7 @@ initialise_gpt(uint8_t *gpt, uint32_t current, uint32_t alternate, int primary)
     }
 
     if (primary) {
-	uuid_generate(disk_uuid);
+	new_uuid(disk_uuid, "disk");
 	reverse_uuid(disk_uuid);
     }
 
@@ -908,8 +947,8 @@ initialise_gpt(uint8_t *gpt, uint32_t current, uint32_t alternate, int primary)
 
     part = (struct gpt_part_header *)gpt;
     if (primary) {
-	uuid_generate(part_uuid);
-	uuid_generate(iso_uuid);
+	new_uuid(part_uuid, "part");
+	new_uuid(iso_uuid, "iso");
 	reverse_uuid(part_uuid);
 	reverse_uuid(iso_uuid);
     }
@@ -941,10 +980,10 @@ initialise_gpt(uint8_t *gpt, uint32_t current, uint32_t alternate, int primary)
     }
 
 
-    header->partitionEntriesCRC = lendian_int (chksum_crc32(gpt,
+    header->partitionEntriesCRC = lendian_int (crc32_update(0, gpt,
 			   header->numParts * header->sizeOfPartitionEntries));
 
-    header->headerCRC = lendian_int(chksum_crc32((uint8_t *)header,
+    header->headerCRC = lendian_int(crc32_update(0, (uint8_t *)header,
 						 header->headerSize));
 }
 
@@ -1001,29 +1040,263 @@ initialise_apm(uint8_t *gpt, uint32_t start)
     }
 }
 
+/*
+ * Stream mode: make sure at least the first 'size' bytes of the image are
+ * in the stream buffer.
+ *
+ * Data are read from stdin in STREAM_CHUNK units, up to STREAM_MAX bytes.
+ */
+void
+stream_fill(off_t size)
+{
+    ssize_t n;
+    size_t new_len;
+
+    if ((size_t) size <= stream.len)
+        return;
+
+    if (size > STREAM_MAX)
+        errx(1, "%s: boot data not within first %d MiB, stream mode not possible", iso_name, STREAM_MAX >> 20);
+
+    new_len = (size + STREAM_CHUNK - 1) / STREAM_CHUNK * STREAM_CHUNK;
+    if (!(stream.buf = realloc(stream.buf, new_len)))
+        err(1, NULL);
+
+    while (stream.len < new_len) {
+        n = read(iso_fd, stream.buf + stream.len, new_len - stream.len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            err(1, "%s: read error", iso_name);
+        }
+        if (!n) break;
+        stream.len += n;
+    }
+
+    if ((size_t) size > stream.len)
+        errx(1, "%s: read error: unexpected end of file", iso_name);
+}
+
+
+void
+read_image(void *buf, size_t len, off_t ofs)
+{
+    ssize_t n;
+
+    if (opt.stream) {
+        stream_fill(ofs + len);
+        memcpy(buf, stream.buf + ofs, len);
+
+        return;
+    }
+
+    n = pread(iso_fd, buf, len, ofs);
+
+    if (n == -1)
+        err(1, "%s: read error", iso_name);
+
+    if ((size_t) n != len)
+        errx(1, "%s: read error: unexpected end of file", iso_name);
+}
+
+
+void
+add_region(off_t ofs, void *buf, size_t len)
+{
+    if (regions_used >= sizeof regions / sizeof *regions)
+        errx(1, "%s: too many regions", iso_name);
+
+    regions[regions_used].ofs = ofs;
+    regions[regions_used].buf = buf;
+    regions[regions_used].len = len;
+    regions_used++;
+}
+
+
+int
+cmp_region(const void *a, const void *b)
+{
+    const struct region *r1 = a, *r2 = b;
+
+    return r1->ofs < r2->ofs ? -1 : r1->ofs > r2->ofs;
+}
+
+
+/*
+ * Write all regions in offset order; adjacent regions are combined into a
+ * single pwritev() call.
+ */
+void
+write_regions(void)
+{
+    struct iovec iov[sizeof regions / sizeof *regions];
+    unsigned i, j;
+    off_t ofs;
+    size_t len;
+
+    qsort(regions, regions_used, sizeof *regions, cmp_region);
+
+    for (i = 0; i < regions_used; i = j) {
+        ofs = regions[i].ofs;
+        len = 0;
+        for (j = i; j < regions_used && regions[j].ofs == ofs + (off_t) len; j++) {
+            iov[j - i].iov_base = regions[j].buf;
+            iov[j - i].iov_len = regions[j].len;
+            len += regions[j].len;
+        }
+
+        if (mode & VERBOSE)
+            printf("write: %zu bytes at %lld\n", len, (long long) ofs);
+
+        if (pwritev(iso_fd, iov, j - i, ofs) != (ssize_t) len)
+            err(1, "%s: write error", iso_name);
+    }
+}
+
+
+void
+write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            err(1, "write error");
+        }
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Stream mode: copy 'len' bytes from stdin to stdout.
+ *
+ * splice() avoids copying the data through user space; it needs a pipe on
+ * at least one side, so fall back to read() + write() if that fails.
+ */
+void
+stream_copy(off_t len)
+{
+    static uint8_t *buf;
+    ssize_t n;
+    int use_splice = 1;
+
+    while (len > 0) {
+        if (use_splice) {
+            n = splice(iso_fd, NULL, stream.out_fd, NULL, len > (1 << 30) ? (1 << 30) : len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                use_splice = 0;
+                continue;
+            }
+        }
+        else {
+            if (!buf && !(buf = malloc(STREAM_CHUNK * 16)))
+                err(1, NULL);
+            n = read(iso_fd, buf, len > STREAM_CHUNK * 16 ? STREAM_CHUNK * 16 : len);
+            if (n > 0) write_all(stream.out_fd, buf, n);
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            err(1, "%s: copy error", iso_name);
+        }
+        if (!n)
+            errx(1, "%s: read error: unexpected end of file", iso_name);
+        len -= n;
+    }
+}
+
+
+/*
+ * Stream mode: make sure stdin has no data beyond the iso file system;
+ * they would otherwise be silently dropped.
+ */
+void
+stream_check_end(void)
+{
+    uint8_t c;
+    ssize_t n;
+
+    while ((n = read(iso_fd, &c, 1)) == -1 && errno == EINTR)
+        ;
+
+    if (n == -1)
+        err(1, "%s: read error", iso_name);
+    if (n)
+        errx(1, "%s: data after end of iso file system, stream mode not possible", iso_name);
+}
+
+
+/*
+ * Stream mode: write zeros to stdout.
+ */
+void
+stream_zero(off_t len)
+{
+    static uint8_t zero[STREAM_CHUNK];
+
+    for (; len > 0; len -= STREAM_CHUNK)
+        write_all(stream.out_fd, zero, len > STREAM_CHUNK ? STREAM_CHUNK : len);
+}
+
+
+/*
+ * Stream mode: write hybrid image of size 'size' to stdout.
+ *
+ * Regions within the stream buffer are applied there; all others must be
+ * past the end of the iso image, in the padding area.
+ */
+void
+write_stream(off_t size)
+{
+    off_t pos, buf_len;
+    unsigned i;
+
+    qsort(regions, regions_used, sizeof *regions, cmp_region);
+
+    for (i = 0; i < regions_used; i++) {
+        if (regions[i].ofs + (off_t) regions[i].len > size)
+            size = regions[i].ofs + regions[i].len;
+    }
+
+    buf_len = (off_t) stream.len < iso_size ? (off_t) stream.len : iso_size;
+
+    for (i = 0; i < regions_used && regions[i].ofs < iso_size; i++) {
+        if (regions[i].ofs + (off_t) regions[i].len > buf_len)
+            errx(1, "%s: region at %lld not in stream buffer", iso_name, (long long) regions[i].ofs);
+        memcpy(stream.buf + regions[i].ofs, regions[i].buf, regions[i].len);
+    }
+
+    if (mode & VERBOSE)
+        printf("stream: %lld bytes buffered, %lld bytes copied\n", (long long) buf_len, (long long) (iso_size - buf_len));
+
+    write_all(stream.out_fd, stream.buf, buf_len);
+    stream_copy(iso_size - buf_len);
+    stream_check_end();
+
+    for (pos = iso_size; i < regions_used; i++) {
+        stream_zero(regions[i].ofs - pos);
+        write_all(stream.out_fd, regions[i].buf, regions[i].len);
+        pos = regions[i].ofs + regions[i].len;
+    }
+
+    stream_zero(size - pos);
+}
+
+
 int
-main(int argc, char *argv[])
+hybrid_image(char *name)
 {
     int i = 0;
-    FILE *fp = NULL;
-    uint8_t *buf = NULL, *bufz = NULL;
+    uint8_t *buf = NULL, *bufz = NULL, *head_buf = NULL, *gpt = NULL;
+    uint8_t grub[0x9fc];
     int cylsize = 0, frac = 0;
     unsigned padding = 0;
-    size_t orig_gpt_size, free_space, gpt_size;
+    size_t orig_gpt_size, free_space;
     struct iso_primary_descriptor descriptor;
     struct stat isostat;
 
-    prog = strcpy(alloca(strlen(argv[0]) + 1), argv[0]);
-    i = check_option(argc, argv);
-    argc -= i;
-    argv += i;
-
-    if (!argc)
-    {
-        usage();
-        return 1;
-    }
-
     if (!(mode & (MODE_MBR | MODE_GPT))) {
         mode |= MODE_MBR;
     }
@@ -1040,21 +1313,24 @@ main(int argc, char *argv[])
 
     srand(time(NULL) << (getppid() << getpid()));
 
-    if (!(fp = fopen(argv[0], "r+"))) // #####
-        err(1, "could not open file `%s'", argv[0]);
+    if (opt.stream) {
+        iso_name = "stdin";
+        iso_fd = STDIN_FILENO;
 
-    if (fseek(fp, (16 << 11), SEEK_SET))
-        err(1, "%s: seek error - 0", argv[0]);
-
-    if (fread(&descriptor, sizeof(char), sizeof(descriptor), fp) != sizeof(descriptor))
-        err(1, "%s: read error - 0", argv[0]);
+        /* stdout is for the image, send messages to stderr */
+        if ((stream.out_fd = dup(STDOUT_FILENO)) == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+            err(1, "stdout");
+    }
+    else {
+        iso_name = name;
+        if ((iso_fd = open(iso_name, O_RDWR)) == -1)
+            err(1, "could not open file `%s'", iso_name);
+    }
 
-    if (fseek(fp, 17 * 2048, SEEK_SET))
-        err(1, "%s: seek error - 1", argv[0]);
+    read_image(&descriptor, sizeof(descriptor), 16 << 11);
 
     bufz = buf = calloc(BUFSIZE, sizeof(char));
-    if (fread(buf, sizeof(char), BUFSIZE, fp) != BUFSIZE)
-        err(1, "%s", argv[0]);
+    read_image(buf, BUFSIZE, 17 * 2048);
 
     check_banner(buf);
 
@@ -1063,22 +1339,18 @@ main(int argc, char *argv[])
     if (mode & VERBOSE)
         printf("catalogue offset: %d\n", catoffset);
 
-    if (fseek(fp, catoffset * 2048, SEEK_SET))
-        err(1, "%s: seek error - 2", argv[0]);
-
     buf = bufz;
     memset(buf, 0, BUFSIZE);
-    if (fread(buf, sizeof(char), BUFSIZE, fp) != BUFSIZE)
-        err(1, "%s", argv[0]);
+    read_image(buf, BUFSIZE, (off_t) catoffset * 2048);
 
     if(mode & LEGACY)
     {
         if (check_catalogue(buf))
-            errx(1, "%s: invalid boot catalogue", argv[0]);
+            errx(1, "%s: invalid boot catalogue", iso_name);
 
         buf += sizeof(ve);
         if (read_catalogue(buf))
-            errx(1, "%s: unexpected boot catalogue parameters", argv[0]);
+            errx(1, "%s: unexpected boot catalogue parameters", iso_name);
 
         if (mode & VERBOSE)
             display_catalogue();
@@ -1094,13 +1366,7 @@ main(int argc, char *argv[])
               if(efi_count < 2) {
                 unsigned char bpb[512];
 
-                if (fseek(fp, (efi_lba * 2048), SEEK_SET)) {
-                  err(1, "%s: seek error - 3", argv[0]);
-                }
-
-                if (fread(bpb, 1, sizeof bpb, fp) != sizeof bpb) {
-                  err(1, "%s", argv[0]);
-                }
+                read_image(bpb, sizeof bpb, (off_t) efi_lba * 2048);
 
                 if((bpb[511] << 8) + bpb[510] == 0xaa55) {
                   unsigned s = bpb[19] + (bpb[20] << 8);
@@ -1109,10 +1375,10 @@ main(int argc, char *argv[])
                 }
               }
 	    } else {
-		errx(1, "%s: invalid efi catalogue", argv[0]);
+		errx(1, "%s: invalid efi catalogue", iso_name);
 	    }
 	} else {
-	    fprintf(stderr, "%s: warning: unable to find efi image\n", argv[0]);
+	    fprintf(stderr, "%s: warning: unable to find efi image\n", iso_name);
 	    mode &= ~EFI;
 	    part_efi = 0;
 	}
@@ -1126,20 +1392,16 @@ main(int argc, char *argv[])
 	    buf += 32;
 	    if (!read_efi_catalogue(buf, &mac_count, &mac_lba) && mac_lba) {
 	    } else {
-		errx(1, "%s: invalid efi catalogue", argv[0]);
+		errx(1, "%s: invalid efi catalogue", iso_name);
 	    }
 	} else {
-	    errx(1, "%s: unable to find mac efi image", argv[0]);
+	    errx(1, "%s: unable to find mac efi image", iso_name);
 	}
     }
 
-    if (fseek(fp, (de_lba * 2048 + 0x40), SEEK_SET))
-        err(1, "%s: seek error - 3", argv[0]);
-
     buf = bufz;
     memset(buf, 0, BUFSIZE);
-    if (fread(buf, sizeof(char), 4, fp) != 4)
-        err(1, "%s", argv[0]);
+    read_image(buf, 4, (off_t) de_lba * 2048 + 0x40);
 
     if (mode & LEGACY)
     {
@@ -1147,27 +1409,26 @@ main(int argc, char *argv[])
             uint64_t tmp, old;
             uint32_t crc;
 
-            if (fseek(fp, ((uint64_t) de_lba * 2048 + 0x9f4), SEEK_SET)) err(1, "%s: seek error - 4", argv[0]);
-            if (fread(&old, 1, 8, fp) != 8) err(1, "%s", argv[0]);
-
-            tmp = lendian_64((uint64_t) de_lba * 4 + 5);
+            /* patch boot image location and adjust checksum */
+            read_image(grub, sizeof grub, (off_t) de_lba * 2048);
 
-            if (fseek(fp, ((uint64_t) de_lba * 2048 + 0x9f4), SEEK_SET)) err(1, "%s: seek error - 4", argv[0]);
-            if (fwrite(&tmp, 1, 8, fp) != 8) err(1, "%s", argv[0]);
+            memcpy(&old, grub + 0x9f4, 8);
+            memcpy(&crc, grub + 20, 4);
 
-            if (fseek(fp, ((uint64_t) de_lba * 2048 + 20), SEEK_SET)) err(1, "%s: seek error - 4", argv[0]);
-            if (fread(&crc, 1, 4, fp) != 4) err(1, "%s", argv[0]);
+            tmp = lendian_64((uint64_t) de_lba * 4 + 5);
 
             crc += tmp - old;
             crc += (tmp >> 32) - (old >> 32);
 
-            if (fseek(fp, ((uint64_t) de_lba * 2048 + 20), SEEK_SET)) err(1, "%s: seek error - 4", argv[0]);
-            if (fwrite(&crc, 1, 4, fp) != 4) err(1, "%s", argv[0]);
+            memcpy(grub + 0x9f4, &tmp, 8);
+            memcpy(grub + 20, &crc, 4);
+
+            add_region((off_t) de_lba * 2048, grub, sizeof grub);
         }
         else if (memcmp(buf, "\xFB\xC0\x78\x70", 4)) {
             warnx("%s: boot loader does not have an isolinux.bin hybrid " \
                      "signature. Note that isolinux-debug.bin does not support " \
-                     "hybrid booting", argv[0]);
+                     "hybrid booting", iso_name);
         }
     }
 
@@ -1184,10 +1445,16 @@ main(int argc, char *argv[])
         }
     }
 
-    if (stat(argv[0], &isostat))
-        err(1, "%s", argv[0]);
-
     iso_size = (off_t) lendian_int(descriptor.size) * lendian_short(descriptor.block_size);
+
+    /* in stream mode, the image ends where the iso file system ends */
+    if (opt.stream) {
+        if ((off_t) stream.len > iso_size)
+            errx(1, "%s: data after end of iso file system, stream mode not possible", iso_name);
+        isostat.st_size = iso_size;
+    }
+    else if (fstat(iso_fd, &isostat))
+        err(1, "%s", iso_name);
     free_space = isostat.st_size - iso_size;
 
     cylsize = head * sector * 512;
@@ -1200,11 +1467,7 @@ main(int argc, char *argv[])
     c = (isostat.st_size + padding) / cylsize;
 
     /* 512 byte header, 128 entries of 128 bytes */
-    orig_gpt_size = gpt_size = 512 + (128 * 128);
-
-    /* Leave space for the APM if necessary */
-    if (mac_lba)
-        gpt_size += (4 * 2048);
+    orig_gpt_size = 512 + (128 * 128);
 
     /*
      * We need to ensure that we have enough space for the secondary GPT.
@@ -1219,45 +1482,37 @@ main(int argc, char *argv[])
 
     if (!id)
     {
-        if (fseek(fp, 440, SEEK_SET))
-            err(1, "%s: seek error - 4", argv[0]);
-
-	if (fread(&id, 1, 4, fp) != 4)
-	    err(1, "%s: read error", argv[0]);
+        read_image(&id, 4, 440);
 
         id = lendian_int(id);
         if (!id)
         {
-            if (mode & VERBOSE)
-                printf("random ");
-            id = rand();
+            if (opt.seed) {
+                uuid_t u;
+
+                new_uuid(u, "mbr");
+                memcpy(&id, u, sizeof id);
+            }
+            else {
+                if (mode & VERBOSE)
+                    printf("random ");
+                id = rand();
+            }
         }
     }
     if (mode & VERBOSE)
         printf("id: %u\n", id);
 
-    buf = bufz;
-    memset(buf, 0, BUFSIZE);
-
-    if (fseek(fp, 0, SEEK_SET))
-        err(1, "%s: seek error - 5", argv[0]);
-
-    /* clean up first 16 blocks */
-    for (i = 0; i < 16; i++) {
-        if (fwrite(buf, sizeof(char), BUFSIZE, fp) != BUFSIZE)
-            err(1, "%s: write error - 1", argv[0]);
-    }
+    /*
+     * The first 16 blocks hold MBR, primary GPT, and APM; anything else
+     * there is cleared.
+     */
+    head_buf = calloc(16, BUFSIZE);
 
-    i = initialise_mbr(buf);
+    i = initialise_mbr(head_buf);
 
     if (mode & VERBOSE)
-        display_mbr(buf, i);
-
-    if (fseek(fp, 0, SEEK_SET))
-        err(1, "%s: seek error - 5", argv[0]);
-
-    if (fwrite(buf, sizeof(char), i, fp) != (size_t)i)
-        err(1, "%s: write error - 1", argv[0]);
+        display_mbr(head_buf, i);
 
     if (mode & MODE_GPT) {
         /* always write primary gpt, if only to cleanup old data */
@@ -1265,70 +1520,388 @@ main(int argc, char *argv[])
 	reverse_uuid(basic_partition);
 	reverse_uuid(hfs_partition);
 
-	buf = calloc(gpt_size, sizeof(char));
-	memset(buf, 0, gpt_size);
-
 	/*
 	 * Primary GPT starts at sector 1, secondary GPT starts at 1 sector
 	 * before the end of the image
 	 */
-	initialise_gpt(buf, 1, iso_filesize / 512 - 1, 1);
-
-	if (fseek(fp, 512, SEEK_SET))
-	    err(1, "%s: seek error - 6", argv[0]);
-
-	if (fwrite(buf, sizeof(char), gpt_size, fp) != (size_t)gpt_size)
-	    err(1, "%s: write error - 2", argv[0]);
+	initialise_gpt(head_buf + 512, 1, iso_filesize / 512 - 1, 1);
     }
 
     if (mac_lba)
     {
 	/* Apple partition entries filling 2048 bytes each */
-	int apm_size = apm_parts * 2048;
+	initialise_apm(head_buf + APM_OFFSET, APM_OFFSET);
+    }
+
+    add_region(0, head_buf, 16 * BUFSIZE);
+
+    if (mode & MODE_GPT) {
+	gpt = calloc(orig_gpt_size, sizeof(char));
+
+	initialise_gpt(gpt + orig_gpt_size - sizeof(struct gpt_header), iso_filesize / 512 - 1, 1, 0);
+
+	/*
+	 * The gpt header is 512 bytes before the end of the image, preceded
+	 * by the 128 GPT entries
+	 */
+	add_region(iso_filesize - orig_gpt_size, gpt, orig_gpt_size);
+    }
 
-	buf = realloc(buf, apm_size);
-	memset(buf, 0, apm_size);
+    if (opt.stream) {
+        write_stream(padding && !opt.size ? iso_filesize : iso_size);
+        iso_fd = stream.out_fd;
+    }
+    else {
+        if (padding && !opt.size)
+        {
+            if (ftruncate(iso_fd, iso_filesize))
+                err(1, "%s: could not add padding bytes", iso_name);
+        }
 
-	initialise_apm(buf, APM_OFFSET);
+        write_regions();
+    }
+
+    /* nothing to sync if the output is a pipe */
+    if (opt.sync == SYNC_DATA && fdatasync(iso_fd) && errno != EINVAL)
+        err(1, "%s: could not synchronise", iso_name);
+
+    if (opt.sync == SYNC_FULL && fsync(iso_fd) && errno != EINVAL)
+        err(1, "%s: could not synchronise", iso_name);
 
-	fseek(fp, APM_OFFSET, SEEK_SET);
-	fwrite(buf, sizeof(char), apm_size, fp);
+    if (close(iso_fd))
+        err(1, "%s: write error", iso_name);
+
+    if (result) {
+        result->id = id;
+        result->gpt = !!(mode & MODE_GPT);
+        memcpy(result->disk_uuid, disk_uuid, sizeof disk_uuid);
+        result->size = padding && !opt.size ? iso_filesize : isostat.st_size;
+        result->done = 1;
+    }
+
+    free(gpt);
+    free(head_buf);
+    free(bufz);
+    free(stream.buf);
+
+    return 0;
+}
+
+
+/*
+ * Print string as JSON string.
+ */
+void
+print_json_str(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(f, "\\%c", *str);
+        else if ((uint8_t) *str < 0x20)
+            fprintf(f, "\\u%04x", (uint8_t) *str);
+        else
+            fputc(*str, f);
     }
+    fputc('"', f);
+}
+
 
-    if (padding && !opt.size)
+/*
+ * Batch mode: check the extra options of one image (argv[1] ... argv[argc - 1]).
+ *
+ * Only the option syntax is checked here; values are checked when the
+ * image is processed. Options for the whole batch are not allowed.
+ *
+ * Return error message (malloc'ed), or NULL if ok.
+ */
+char *
+check_batch_option(int argc, char *argv[])
+{
+    char **args, *msg = NULL;
+    unsigned u;
+    int n;
+
+    /* getopt reorders its arguments */
+    if (!(args = malloc((argc + 1) * sizeof *args)))
+        err(1, NULL);
+    memcpy(args, argv, (argc + 1) * sizeof *args);
+
+    opterr = 0;
+    optind = 0;
+    while (!msg && (optopt = 0, n = getopt_long_only(argc, args, optstr, lopt, NULL)) != -1)
     {
-        if (fsync(fileno(fp)))
-            err(1, "%s: could not synchronise", argv[0]);
+        switch (n)
+        {
+        case 'V':
+        case 1012:
+        case 1013:
+        case 1014:
+            for (u = 0; lopt[u].name && lopt[u].val != n; u++);
+            if (asprintf(&msg, "%s: option `--%s' not allowed in batch file", program_invocation_short_name, lopt[u].name) == -1)
+                err(1, NULL);
+            break;
+
+        case ':':
+            if (asprintf(&msg, "%s: option `%s' takes an argument", program_invocation_short_name, args[optind - 1]) == -1)
+                err(1, NULL);
+            break;
 
-        if (ftruncate(fileno(fp), iso_filesize))
-            err(1, "%s: could not add padding bytes", argv[0]);
+        case '?':
+            if (optopt)
+                n = asprintf(&msg, "%s: invalid option `-%c'", program_invocation_short_name, optopt);
+            else
+                n = asprintf(&msg, "%s: invalid option `%s'", program_invocation_short_name, args[optind - 1]);
+            if (n == -1)
+                err(1, NULL);
+            break;
+        }
     }
 
-    if (mode & MODE_GPT) {
-	buf = realloc(buf, orig_gpt_size);
-	memset(buf, 0, orig_gpt_size);
+    if (!msg && optind < argc) {
+        if (asprintf(&msg, "%s: unexpected argument `%s'", program_invocation_short_name, args[optind]) == -1)
+            err(1, NULL);
+    }
 
-	buf += orig_gpt_size - sizeof(struct gpt_header);
+    free(args);
 
-	initialise_gpt(buf, iso_filesize / 512 - 1, 1, 0);
+    return msg;
+}
 
-	/* Shift back far enough to write the 128 GPT entries */
-	buf -= 128 * sizeof(struct gpt_part_header);
 
-	/*
-	 * Seek far enough back that the gpt header is 512 bytes before the
-	 * end of the image
-	 */
+/*
+ * Batch mode: report result of a single image as one line of JSON.
+ *
+ * - name: image name
+ * - status: wait() status of the process handling the image
+ * - res: result as set by hybrid_image()
+ * - log: messages written while handling the image
+ * - error: why the image was not processed at all (status, res and log
+ *   are unused then), or NULL
+ */
+void
+batch_report(const char *name, int status, struct batch_result *res, FILE *log, const char *error)
+{
+    char line[256], msg[256] = "";
+    char guid[37];
+    uuid_t u;
 
-	if (fseek(fp, iso_filesize - orig_gpt_size, SEEK_SET))
-	    err(1, "%s: seek error - 8", argv[0]);
+    if (error) {
+        snprintf(msg, sizeof msg, "%s", error);
+    }
+    else {
+        rewind(log);
+        while (fgets(line, sizeof line, log)) {
+            line[strcspn(line, "\n")] = 0;
+            if (*line) strcpy(msg, line);
+        }
+    }
+
+    printf("{\"image\": ");
+    print_json_str(stdout, name);
+
+    if (error) {
+        printf(", \"ok\": false");
+    }
+    else if (WIFEXITED(status) && !WEXITSTATUS(status) && res->done) {
+        memcpy(u, res->disk_uuid, sizeof u);
+        reverse_uuid(u);
+        uuid_unparse(u, guid);
+        printf(", \"ok\": true, \"size\": %lld, \"mbr_id\": \"0x%08x\"", (long long) res->size, res->id);
+        if (res->gpt)
+            printf(", \"disk_guid\": \"%s\"", guid);
+    }
+    else {
+        printf(", \"ok\": false");
+        if (WIFEXITED(status))
+            printf(", \"exit\": %d", WEXITSTATUS(status));
+        else if (WIFSIGNALED(status))
+            printf(", \"signal\": %d", WTERMSIG(status));
+    }
 
-	if (fwrite(buf, sizeof(char), orig_gpt_size, fp) != orig_gpt_size)
-	    err(1, "%s: write error - 4", argv[0]);
+    if (*msg) {
+        printf(", \"message\": ");
+        print_json_str(stdout, msg);
     }
 
-    free(buf);
-    fclose(fp);
+    printf("}\n");
+    fflush(stdout);
+}
 
-    return 0;
+
+/*
+ * Batch mode: process all images listed in opt.batch.
+ *
+ * Each line holds an image name, optionally followed by options that are
+ * added to the global ones. Empty lines and lines starting with '#' are
+ * ignored. Name and options are separated by white space; there is no
+ * quoting, so image names can't contain spaces.
+ *
+ * The options are checked up front (see check_batch_option()); images
+ * with invalid options are reported as failed without being processed.
+ *
+ * Every image is handled in a separate process (isohybrid keeps its state
+ * in global variables), with up to opt.jobs processes running at the same
+ * time. For each image, a line of JSON is written to stdout.
+ *
+ * Return number of failed images.
+ */
+int
+run_batch(int argc, char *argv[])
+{
+    FILE *f;
+    char *line = NULL, *s;
+    size_t line_size = 0;
+    struct job {
+        char *name;
+        char **argv;
+        int argc;
+        char *error;
+        pid_t pid;
+        FILE *log;
+    } *jobs = NULL, *job;
+    unsigned jobs_used = 0, next = 0, running = 0, failed = 0, u;
+    struct batch_result *results;
+    int i, status;
+    pid_t pid;
+
+    if (!(f = strcmp(opt.batch, "-") ? fopen(opt.batch, "r") : stdin))
+        err(1, "%s", opt.batch);
+
+    while (getline(&line, &line_size, f) > 0) {
+        if (!(s = strtok(line, " \t\n")) || *s == '#') continue;
+
+        if (!(jobs = realloc(jobs, (jobs_used + 1) * sizeof *jobs)))
+            err(1, NULL);
+        job = jobs + jobs_used++;
+
+        job->name = strdup(s);
+        job->pid = 0;
+        job->log = NULL;
+        job->argv = malloc((argc + 1) * sizeof *job->argv);
+        memcpy(job->argv, argv, argc * sizeof *job->argv);
+        job->argc = argc;
+        while ((s = strtok(NULL, " \t\n"))) {
+            job->argv = realloc(job->argv, (job->argc + 2) * sizeof *job->argv);
+            job->argv[job->argc++] = strdup(s);
+        }
+        job->argv[job->argc] = NULL;
+
+        /* per-image options only, after the program name */
+        job->argv[argc - 1] = job->argv[0];
+        job->error = check_batch_option(job->argc - argc + 1, job->argv + argc - 1);
+        job->argv[argc - 1] = argv[argc - 1];
+    }
+
+    if (f != stdin) fclose(f);
+    free(line);
+
+    if (!jobs_used)
+        return 0;
+
+    results = mmap(NULL, jobs_used * sizeof *results, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+        err(1, NULL);
+
+    if (!opt.jobs) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opt.jobs = cpus > 0 ? cpus : 1;
+    }
+
+    while (next < jobs_used || running) {
+        if (next < jobs_used && running < opt.jobs) {
+            job = jobs + next;
+
+            if (job->error) {
+                batch_report(job->name, 0, NULL, NULL, job->error);
+                failed++;
+                next++;
+
+                continue;
+            }
+
+            if (!(job->log = tmpfile()))
+                err(1, NULL);
+
+            fflush(stdout);
+            if ((job->pid = fork()) == -1)
+                err(1, "fork");
+
+            if (!job->pid) {
+                dup2(fileno(job->log), STDOUT_FILENO);
+                dup2(fileno(job->log), STDERR_FILENO);
+
+                result = results + next;
+
+                /* start over with global + per-image options */
+                optind = 0;
+                check_option(job->argc, job->argv);
+
+                exit(hybrid_image(job->name));
+            }
+
+            next++;
+            running++;
+
+            continue;
+        }
+
+        if ((pid = wait(&status)) == -1)
+            err(1, "wait");
+
+        for (u = 0; u < next; u++) {
+            if (jobs[u].pid != pid) continue;
+
+            batch_report(jobs[u].name, status, results + u, jobs[u].log, NULL);
+            if (!(WIFEXITED(status) && !WEXITSTATUS(status) && results[u].done))
+                failed++;
+
+            fclose(jobs[u].log);
+            jobs[u].pid = 0;
+            running--;
+        }
+    }
+
+    munmap(results, jobs_used * sizeof *results);
+
+    for (u = 0; u < jobs_used; u++) {
+        for (i = argc; i < jobs[u].argc; i++) free(jobs[u].argv[i]);
+        free(jobs[u].argv);
+        free(jobs[u].name);
+        free(jobs[u].error);
+    }
+    free(jobs);
+
+    return failed;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+
+    prog = strcpy(alloca(strlen(argv[0]) + 1), argv[0]);
+    i = check_option(argc, argv);
+
+    if (opt.batch) {
+        if (argc != i || opt.stream)
+        {
+            usage();
+            return 1;
+        }
+
+        return run_batch(argc, argv) ? 1 : 0;
+    }
+
+    argc -= i;
+    argv += i;
+
+    if (argc != !opt.stream)
+    {
+        usage();
+        return 1;
+    }
+
+    return hybrid_image(argv[0]);
 }
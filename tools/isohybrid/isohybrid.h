@@ -24,4 +24,8 @@
 #define BUFSIZE     2048
 #define MBRSIZE      432
 
+/* stream mode: read size and max. buffered image start */
+#define STREAM_CHUNK    (64 << 10)
+#define STREAM_MAX      (64 << 20)
+
 /* End of header file */
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+
+/*
+ * Chunk cache benchmark.
+ *
+ * Usage: cache_bench [chunks]
+ *
+ * Stores chunks (default 100000) in random order, then times lookups,
+ * in-order export, and disk_to_fd(). For comparison, lookups are also
+ * timed on a plain linked list searched front to back (the way the cache
+ * used to work) - on a sample only, as a full run takes minutes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "util.h"
+#include "disk.h"
+
+// lookups timed on the linked list
+#define LIST_SAMPLE	2000
+
+typedef struct list_s {
+  struct list_s *next;
+  uint64_t chunk_nr;
+} list_t;
+
+static double now(void);
+static uint64_t *shuffled(unsigned count);
+
+
+int main(int argc, char **argv)
+{
+  unsigned count = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+  uint64_t *chunk_nr = shuffled(count);
+  uint8_t buf[512] = {};
+  disk_t disk = { .chunk_size = 512, .sector_size = 512, .fd = -1 };
+  unsigned hits = 0;
+  double t;
+
+  disk.size_in_bytes = (uint64_t) count * disk.chunk_size;
+
+  printf("%u chunks\n", count);
+
+  t = now();
+  for(unsigned u = 0; u < count; u++) {
+    memcpy(buf, chunk_nr + u, sizeof *chunk_nr);
+    disk_cache_store(&disk, buf, chunk_nr[u]);
+  }
+  printf("  store:          %8.3f s\n", now() - t);
+
+  t = now();
+  for(unsigned u = 0; u < count; u++) hits += disk_cache_read(&disk, buf, chunk_nr[count - 1 - u]);
+  printf("  lookup:         %8.3f s\n", now() - t);
+
+  if(hits != count) {
+    fprintf(stderr, "cache lookup failed: %u of %u found\n", hits, count);
+    return 1;
+  }
+
+  t = now();
+  disk_export(&disk, "/dev/null", 1);
+  printf("  text export:    %8.3f s\n", now() - t);
+
+  t = now();
+  disk_to_fd(&disk);
+  printf("  disk_to_fd:     %8.3f s\n", now() - t);
+
+  // linked list, newest entry first
+  list_t *list = NULL;
+
+  for(unsigned u = 0; u < count; u++) {
+    list_t *l = malloc(sizeof *l);
+    l->chunk_nr = chunk_nr[u];
+    l->next = list;
+    list = l;
+  }
+
+  unsigned sample = count < LIST_SAMPLE ? count : LIST_SAMPLE;
+
+  hits = 0;
+  t = now();
+  for(unsigned u = 0; u < sample; u++) {
+    for(list_t *l = list; l; l = l->next) {
+      if(l->chunk_nr == chunk_nr[u * (count / sample)]) {
+        hits++;
+        break;
+      }
+    }
+  }
+  t = now() - t;
+  printf("  list lookup:    %8.3f s (estimated from %u lookups)\n", t * count / sample, sample);
+
+  while(list) {
+    list_t *l = list->next;
+    free(list);
+    list = l;
+  }
+
+  free(chunk_nr);
+
+  return hits == sample ? 0 : 1;
+}
+
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Chunk numbers 0 .. count - 1 in random order.
+ */
+uint64_t *shuffled(unsigned count)
+{
+  uint64_t *list = malloc((count ?: 1) * sizeof *list);
+
+  for(unsigned u = 0; u < count; u++) list[u] = u;
+
+  srandom(1);
+  for(unsigned u = count; u > 1; u--) {
+    unsigned i = random() % u;
+    uint64_t tmp = list[u - 1];
+    list[u - 1] = list[i];
+    list[i] = tmp;
+  }
+
+  return list;
+}
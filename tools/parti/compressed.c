@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#include "util.h"
+#include "disk.h"
+#include "compressed.h"
+
+/*
+ * xz or zstd compressed disk images.
+ *
+ * Images are split into frames (xz blocks, zstd frames) that can be
+ * decompressed independently. The frame list comes from the xz index or
+ * the zstd seek table (zstd seekable format). Only frames that are
+ * actually read get decompressed; the most recently used ones are kept,
+ * up to COMPRESSED_CACHE_SIZE.
+ *
+ * Without usable index (or with huge frames), the image is decompressed
+ * sequentially from the start, in COMPRESSED_WINDOW sized pieces that are
+ * cached the same way. Going back beyond the cached data means starting
+ * over, so this can be slow.
+ */
+
+static size_t compressed_file_read(disk_t *disk, void *buffer, size_t len, uint64_t offset);
+static int xz_index(disk_t *disk, uint64_t file_size, uint64_t *size);
+static int zstd_index(disk_t *disk, uint64_t file_size);
+static int xz_decode(disk_t *disk, compressed_frame_t *frame);
+static int zstd_decode(disk_t *disk, compressed_frame_t *frame);
+static int compressed_seq_reset(disk_t *disk);
+static size_t compressed_seq_read(disk_t *disk, uint8_t *buffer, size_t len);
+static int compressed_seq_decode(disk_t *disk, unsigned idx);
+static void compressed_evict(compressed_t *c, uint64_t size);
+static uint8_t *compressed_frame(disk_t *disk, unsigned idx);
+
+
+/*
+ * Read from the compressed image file.
+ */
+static size_t compressed_file_read(disk_t *disk, void *buffer, size_t len, uint64_t offset)
+{
+  size_t pos = 0;
+
+  while(pos < len) {
+    ssize_t r = pread(disk->fd, buffer + pos, len - pos, offset + pos);
+    disk->stats.read_calls++;
+    if(r <= 0) break;
+    disk->stats.bytes_read += r;
+    pos += r;
+  }
+
+  return pos;
+}
+
+
+/*
+ * Check if disk is an xz or zstd compressed image and set it up.
+ *
+ * On success, disk->size_in_bytes is the uncompressed size.
+ *
+ * Returns 1 if it is a compressed image, else 0.
+ */
+int compressed_open(disk_t *disk)
+{
+  uint8_t magic[sizeof XZ_MAGIC - 1] = {};
+  compressed_type_t type;
+
+  // O_DIRECT needs aligned reads; and is of no use here anyway
+  int fd = disk->direct ? open(disk->name, O_RDONLY | O_LARGEFILE) : disk->fd;
+
+  if(fd == -1) return 0;
+
+  if(pread(fd, magic, sizeof magic, 0) != sizeof magic) magic[0] = 0;
+
+  if(!memcmp(magic, XZ_MAGIC, sizeof XZ_MAGIC - 1)) {
+    type = compressed_xz;
+  }
+  else if(!memcmp(magic, ZSTD_MAGIC, sizeof ZSTD_MAGIC - 1)) {
+    type = compressed_zstd;
+  }
+  else {
+    if(fd != disk->fd) close(fd);
+
+    return 0;
+  }
+
+  if(fd != disk->fd) {
+    close(disk->fd);
+    disk->fd = fd;
+    disk->direct = 0;
+  }
+
+  compressed_t *c = disk->compressed = calloc(1, sizeof *disk->compressed);
+  uint64_t file_size = disk->size_in_bytes, size = 0;
+  int ok;
+
+  c->type = type;
+
+  if(type == compressed_xz) {
+    ok = xz_index(disk, file_size, &size);
+  }
+  else {
+    ok = zstd_index(disk, file_size);
+    if(ok) size = c->frames[c->frame_count - 1].start + c->frames[c->frame_count - 1].size;
+  }
+
+  for(unsigned u = 0; ok && u < c->frame_count; u++) {
+    if(c->frames[u].size > COMPRESSED_FRAME_MAX) ok = 0;
+  }
+
+  if(!ok) {
+    fprintf(stderr,
+      "%s: no %s, decompressing sequentially - this may be slow\n",
+      disk->name, type == compressed_xz ? "usable xz index" : "zstd seek table"
+    );
+
+    c->sequential = 1;
+
+    free(c->frames);
+    c->frames = NULL;
+    c->frame_count = 0;
+
+    if(size) {
+      c->frame_count = (size + COMPRESSED_WINDOW - 1) / COMPRESSED_WINDOW;
+      c->frames = calloc(c->frame_count ?: 1, sizeof *c->frames);
+
+      for(unsigned u = 0; u < c->frame_count; u++) {
+        c->frames[u].start = (uint64_t) u * COMPRESSED_WINDOW;
+        c->frames[u].size = size - c->frames[u].start < COMPRESSED_WINDOW ? size - c->frames[u].start : COMPRESSED_WINDOW;
+      }
+    }
+    else if(compressed_seq_reset(disk)) {
+      // without index, we have to go through the whole image to get its
+      // size; keep the start of the image, that's what gets read most
+      uint8_t *buf = malloc(COMPRESSED_WINDOW);
+      size_t len;
+
+      while((len = compressed_seq_read(disk, buf, COMPRESSED_WINDOW))) {
+        c->frames = reallocarray(c->frames, c->frame_count + 1, sizeof *c->frames);
+
+        compressed_frame_t *frame = c->frames + c->frame_count++;
+
+        *frame = (compressed_frame_t) { .start = size, .size = len };
+
+        if(c->cached + len <= COMPRESSED_CACHE_SIZE) {
+          frame->data = buf;
+          buf = malloc(COMPRESSED_WINDOW);
+          c->cached += len;
+          c->decoded++;
+        }
+
+        size += len;
+        c->seq.pos += len;
+
+        if(len < COMPRESSED_WINDOW) break;
+      }
+
+      free(buf);
+    }
+  }
+
+  disk->size_in_bytes = size;
+
+  return 1;
+}
+
+
+/*
+ * Read len bytes at offset of the uncompressed image.
+ *
+ * Returns the number of bytes read (less than len on error or at the end
+ * of the image).
+ */
+size_t compressed_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset)
+{
+  compressed_t *c = disk->compressed;
+  size_t pos = 0;
+
+  while(pos < len && offset + pos < disk->size_in_bytes) {
+    uint64_t ofs = offset + pos;
+
+    // last frame with start <= ofs
+    unsigned lo = 0, hi = c->frame_count;
+    while(lo < hi) {
+      unsigned mid = lo + (hi - lo) / 2;
+      if(c->frames[mid].start <= ofs) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+
+    if(!lo) break;
+
+    compressed_frame_t *frame = c->frames + lo - 1;
+    uint8_t *data = compressed_frame(disk, lo - 1);
+
+    if(!data || ofs >= frame->start + frame->size) break;
+
+    size_t size = frame->start + frame->size - ofs < len - pos ? frame->start + frame->size - ofs : len - pos;
+    memcpy(buffer + pos, data + (ofs - frame->start), size);
+    pos += size;
+  }
+
+  return pos;
+}
+
+
+void compressed_free(disk_t *disk)
+{
+  compressed_t *c = disk->compressed;
+
+  if(!c) return;
+
+  for(unsigned u = 0; u < c->frame_count; u++) free(c->frames[u].data);
+  free(c->frames);
+
+  if(c->seq.stream) {
+    if(c->type == compressed_xz) {
+      lzma_end(c->seq.stream);
+      free(c->seq.stream);
+    }
+    else {
+      ZSTD_freeDStream(c->seq.stream);
+    }
+  }
+  free(c->seq.buf);
+
+  free(c);
+  disk->compressed = NULL;
+}
+
+
+/*
+ * Build frame list from the xz index (of all streams in the file).
+ *
+ * size is set to the uncompressed size, even if the frame list can't be
+ * used for some reason.
+ *
+ * Returns 1 on success, else 0.
+ */
+static int xz_index(disk_t *disk, uint64_t file_size, uint64_t *size)
+{
+  compressed_t *c = disk->compressed;
+  lzma_index *index = NULL;
+  uint64_t pos = file_size, padding = 0;
+  uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+  int ok = 1;
+
+  // go backwards through all streams
+  while(pos > 0 && ok) {
+    ok = 0;
+
+    if(pos < 2 * LZMA_STREAM_HEADER_SIZE) break;
+
+    if(compressed_file_read(disk, buf, 4, pos - 4) != 4) break;
+
+    // stream padding
+    if(!memcmp(buf, "\0\0\0\0", 4)) {
+      pos -= 4;
+      padding += 4;
+      ok = 1;
+      continue;
+    }
+
+    lzma_stream_flags footer, header;
+
+    if(compressed_file_read(disk, buf, sizeof buf, pos - sizeof buf) != sizeof buf) break;
+    if(lzma_stream_footer_decode(&footer, buf) != LZMA_OK) break;
+    if(pos - 2 * LZMA_STREAM_HEADER_SIZE < footer.backward_size) break;
+
+    uint8_t *index_buf = malloc(footer.backward_size);
+    lzma_index *stream_index = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos = 0;
+
+    if(
+      compressed_file_read(disk, index_buf, footer.backward_size, pos - LZMA_STREAM_HEADER_SIZE - footer.backward_size) != footer.backward_size ||
+      lzma_index_buffer_decode(&stream_index, &memlimit, NULL, index_buf, &in_pos, footer.backward_size) != LZMA_OK
+    ) {
+      free(index_buf);
+      break;
+    }
+
+    free(index_buf);
+
+    uint64_t stream_size = lzma_index_stream_size(stream_index);
+
+    if(
+      stream_size > pos ||
+      compressed_file_read(disk, buf, sizeof buf, pos - stream_size) != sizeof buf ||
+      lzma_stream_header_decode(&header, buf) != LZMA_OK ||
+      lzma_stream_flags_compare(&header, &footer) != LZMA_OK ||
+      lzma_index_stream_flags(stream_index, &footer) != LZMA_OK ||
+      lzma_index_stream_padding(stream_index, padding) != LZMA_OK ||
+      (index && lzma_index_cat(stream_index, index, NULL) != LZMA_OK)
+    ) {
+      lzma_index_end(stream_index, NULL);
+      break;
+    }
+
+    index = stream_index;
+    pos -= stream_size;
+    padding = 0;
+    ok = 1;
+  }
+
+  if(!index) return 0;
+
+  *size = lzma_index_uncompressed_size(index);
+
+  if(ok) {
+    lzma_index_iter iter;
+
+    c->frames = calloc(lzma_index_block_count(index) ?: 1, sizeof *c->frames);
+
+    lzma_index_iter_init(&iter, index);
+    while(!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+      c->frames[c->frame_count++] = (compressed_frame_t) {
+        .start = iter.block.uncompressed_file_offset,
+        .size = iter.block.uncompressed_size,
+        .file_offset = iter.block.compressed_file_offset,
+        .file_size = iter.block.total_size,
+        .check = iter.stream.flags->check
+      };
+    }
+
+    if(!c->frame_count) ok = 0;
+  }
+
+  lzma_index_end(index, NULL);
+
+  return ok;
+}
+
+
+/*
+ * Build frame list from the zstd seek table.
+ *
+ * Returns 1 on success, else 0.
+ */
+static int zstd_index(disk_t *disk, uint64_t file_size)
+{
+  compressed_t *c = disk->compressed;
+  uint8_t footer[ZSTD_SEEKABLE_FOOTER];
+
+  if(file_size < 8 + ZSTD_SEEKABLE_FOOTER) return 0;
+
+  if(compressed_file_read(disk, footer, sizeof footer, file_size - sizeof footer) != sizeof footer) return 0;
+
+  if(read_dword_le(footer + 5) != ZSTD_SEEKABLE_MAGIC) return 0;
+
+  unsigned frames = read_dword_le(footer);
+  unsigned descriptor = footer[4];
+
+  // reserved bits
+  if((descriptor & 0x7c)) return 0;
+
+  unsigned entry_size = (descriptor & 0x80) ? 12 : 8;
+  uint64_t table_size = (uint64_t) frames * entry_size;
+
+  if(!frames || 8 + table_size + ZSTD_SEEKABLE_FOOTER > file_size) return 0;
+
+  uint8_t *table = malloc(8 + table_size);
+  uint64_t data_size = file_size - (8 + table_size + ZSTD_SEEKABLE_FOOTER);
+
+  if(
+    compressed_file_read(disk, table, 8 + table_size, data_size) != 8 + table_size ||
+    read_dword_le(table) != ZSTD_SKIPPABLE_MAGIC ||
+    read_dword_le(table + 4) != table_size + ZSTD_SEEKABLE_FOOTER
+  ) {
+    free(table);
+    return 0;
+  }
+
+  c->frames = calloc(frames, sizeof *c->frames);
+
+  uint64_t file_offset = 0, start = 0;
+
+  for(unsigned u = 0; u < frames; u++) {
+    uint8_t *entry = table + 8 + (uint64_t) u * entry_size;
+    compressed_frame_t *frame = c->frames + u;
+
+    frame->file_offset = file_offset;
+    frame->file_size = read_dword_le(entry);
+    frame->start = start;
+    frame->size = read_dword_le(entry + 4);
+
+    file_offset += frame->file_size;
+    start += frame->size;
+  }
+
+  free(table);
+
+  c->frame_count = frames;
+
+  return file_offset == data_size;
+}
+
+
+static int xz_decode(disk_t *disk, compressed_frame_t *frame)
+{
+  uint8_t *in = malloc(frame->file_size);
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_block block = { .version = 0, .check = frame->check, .filters = filters };
+  size_t in_pos, out_pos = 0;
+  int ok = 0;
+
+  if(frame->file_size && compressed_file_read(disk, in, frame->file_size, frame->file_offset) == frame->file_size) {
+    block.header_size = lzma_block_header_size_decode(in[0]);
+
+    if(block.header_size <= frame->file_size && lzma_block_header_decode(&block, NULL, in) == LZMA_OK) {
+      in_pos = block.header_size;
+
+      ok = lzma_block_buffer_decode(&block, NULL, in, &in_pos, frame->file_size, frame->data, &out_pos, frame->size) == LZMA_OK;
+
+      for(unsigned u = 0; filters[u].id != LZMA_VLI_UNKNOWN; u++) free(filters[u].options);
+    }
+  }
+
+  free(in);
+
+  return ok && out_pos == frame->size;
+}
+
+
+static int zstd_decode(disk_t *disk, compressed_frame_t *frame)
+{
+  uint8_t *in = malloc(frame->file_size ?: 1);
+  int ok = 0;
+
+  if(compressed_file_read(disk, in, frame->file_size, frame->file_offset) == frame->file_size) {
+    ok = ZSTD_decompress(frame->data, frame->size, in, frame->file_size) == frame->size;
+  }
+
+  free(in);
+
+  return ok;
+}
+
+
+/*
+ * Start sequential decompression from the beginning.
+ *
+ * Returns 1 on success, else 0.
+ */
+static int compressed_seq_reset(disk_t *disk)
+{
+  compressed_t *c = disk->compressed;
+  int ok;
+
+  if(c->type == compressed_xz) {
+    if(!c->seq.stream) {
+      c->seq.stream = calloc(1, sizeof (lzma_stream));
+    }
+    else {
+      lzma_end(c->seq.stream);
+    }
+    *(lzma_stream *) c->seq.stream = (lzma_stream) LZMA_STREAM_INIT;
+    ok = lzma_stream_decoder(c->seq.stream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+  }
+  else {
+    if(!c->seq.stream) c->seq.stream = ZSTD_createDStream();
+    ok = c->seq.stream && !ZSTD_isError(ZSTD_initDStream(c->seq.stream));
+  }
+
+  if(!c->seq.buf) c->seq.buf = malloc(COMPRESSED_WINDOW);
+
+  c->seq.pos = c->seq.file_pos = 0;
+  c->seq.buf_pos = c->seq.buf_len = 0;
+
+  return ok;
+}
+
+
+/*
+ * Decompress the next len bytes.
+ *
+ * Returns the number of bytes decompressed (less than len on error or at
+ * the end of the image). The caller has to update c->seq.pos.
+ */
+static size_t compressed_seq_read(disk_t *disk, uint8_t *buffer, size_t len)
+{
+  compressed_t *c = disk->compressed;
+  size_t pos = 0;
+
+  while(pos < len) {
+    if(c->seq.buf_pos == c->seq.buf_len) {
+      c->seq.buf_len = compressed_file_read(disk, c->seq.buf, COMPRESSED_WINDOW, c->seq.file_pos);
+      c->seq.file_pos += c->seq.buf_len;
+      c->seq.buf_pos = 0;
+    }
+
+    size_t old_pos = pos, old_buf_pos = c->seq.buf_pos;
+
+    if(c->type == compressed_xz) {
+      lzma_stream *strm = c->seq.stream;
+
+      strm->next_in = c->seq.buf + c->seq.buf_pos;
+      strm->avail_in = c->seq.buf_len - c->seq.buf_pos;
+      strm->next_out = buffer + pos;
+      strm->avail_out = len - pos;
+
+      lzma_ret ret = lzma_code(strm, strm->avail_in ? LZMA_RUN : LZMA_FINISH);
+
+      c->seq.buf_pos = c->seq.buf_len - strm->avail_in;
+      pos = len - strm->avail_out;
+
+      if(ret != LZMA_OK) break;
+    }
+    else {
+      ZSTD_inBuffer in = { c->seq.buf, c->seq.buf_len, c->seq.buf_pos };
+      ZSTD_outBuffer out = { buffer, len, pos };
+
+      if(ZSTD_isError(ZSTD_decompressStream(c->seq.stream, &out, &in))) break;
+
+      c->seq.buf_pos = in.pos;
+      pos = out.pos;
+    }
+
+    // end of file
+    if(pos == old_pos && c->seq.buf_pos == old_buf_pos && !c->seq.buf_len) break;
+  }
+
+  return pos;
+}
+
+
+/*
+ * Decompress window idx of a sequentially read image.
+ *
+ * All windows on the way are decompressed, too, and kept as long as
+ * there's room.
+ *
+ * Returns 1 on success, else 0.
+ */
+static int compressed_seq_decode(disk_t *disk, unsigned idx)
+{
+  compressed_t *c = disk->compressed;
+
+  if(!c->seq.stream || c->seq.pos > c->frames[idx].start) {
+    if(c->seq.stream) c->restarts++;
+    if(!compressed_seq_reset(disk)) return 0;
+  }
+
+  while(c->seq.pos <= c->frames[idx].start) {
+    compressed_frame_t *frame = c->frames + c->seq.pos / COMPRESSED_WINDOW;
+    uint8_t *buf = malloc(frame->size);
+
+    if(compressed_seq_read(disk, buf, frame->size) != frame->size) {
+      free(buf);
+
+      return 0;
+    }
+
+    c->seq.pos += frame->size;
+
+    if(frame->data) {
+      free(buf);
+      continue;
+    }
+
+    compressed_evict(c, frame->size);
+
+    frame->data = buf;
+    c->cached += frame->size;
+    c->decoded++;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Drop least recently used frames to make room for size bytes.
+ */
+static void compressed_evict(compressed_t *c, uint64_t size)
+{
+  while(c->cached && c->cached + size > COMPRESSED_CACHE_SIZE) {
+    compressed_frame_t *lru = NULL;
+
+    for(unsigned u = 0; u < c->frame_count; u++) {
+      if(c->frames[u].data && (!lru || c->frames[u].used < lru->used)) lru = c->frames + u;
+    }
+
+    if(!lru) break;
+
+    free(lru->data);
+    lru->data = NULL;
+    c->cached -= lru->size;
+  }
+}
+
+
+/*
+ * Get decompressed data of frame idx.
+ *
+ * Returns NULL on error.
+ */
+static uint8_t *compressed_frame(disk_t *disk, unsigned idx)
+{
+  compressed_t *c = disk->compressed;
+  compressed_frame_t *frame = c->frames + idx;
+
+  frame->used = ++c->clock;
+
+  if(frame->data) return frame->data;
+
+  if(c->sequential) return compressed_seq_decode(disk, idx) ? frame->data : NULL;
+
+  compressed_evict(c, frame->size);
+
+  frame->data = malloc(frame->size ?: 1);
+
+  if(!(c->type == compressed_xz ? xz_decode(disk, frame) : zstd_decode(disk, frame))) {
+    free(frame->data);
+    frame->data = NULL;
+
+    return NULL;
+  }
+
+  c->cached += frame->size;
+  c->decoded++;
+
+  return frame->data;
+}
@@ -0,0 +1,50 @@
+#define XZ_MAGIC		"\xfd" "7zXZ\x00"
+#define ZSTD_MAGIC		"\x28\xb5\x2f\xfd"
+
+// zstd seekable format, see zstd/contrib/seekable_format
+#define ZSTD_SEEKABLE_MAGIC	0x8f92eab1
+#define ZSTD_SKIPPABLE_MAGIC	0x184d2a5e
+#define ZSTD_SEEKABLE_FOOTER	9
+
+// max. memory for decompressed frames
+#define COMPRESSED_CACHE_SIZE	(64 << 20)
+
+// unit for images that have to be decompressed sequentially
+#define COMPRESSED_WINDOW	(1 << 20)
+
+// frames larger than this are not decompressed in one go
+#define COMPRESSED_FRAME_MAX	(256 << 20)
+
+typedef enum { compressed_xz, compressed_zstd } compressed_type_t;
+
+typedef struct {
+  uint64_t start;		// uncompressed offset
+  uint64_t size;		// uncompressed size
+  uint64_t file_offset;		// compressed data in image file (not for sequential images)
+  uint64_t file_size;
+  unsigned check;		// xz check type
+  uint8_t *data;		// decompressed data (or NULL)
+  uint64_t used;		// for LRU: last access
+} compressed_frame_t;
+
+typedef struct compressed_s {
+  compressed_type_t type;
+  unsigned sequential:1;	// no usable index: decompress from start
+  compressed_frame_t *frames;	// sorted by start
+  unsigned frame_count;
+  uint64_t cached;		// bytes in decompressed frames
+  uint64_t clock;		// LRU clock
+  uint64_t decoded;		// frames decompressed
+  uint64_t restarts;		// sequential decompression restarts
+  struct {
+    void *stream;		// lzma_stream or ZSTD_DStream
+    uint64_t pos;		// uncompressed position
+    uint64_t file_pos;		// compressed position
+    uint8_t *buf;		// input buffer
+    size_t buf_pos, buf_len;
+  } seq;
+} compressed_t;
+
+int compressed_open(disk_t *disk);
+size_t compressed_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset);
+void compressed_free(disk_t *disk);
@@ -2,6 +2,7 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,60 +11,306 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <linux/fs.h>   /* BLKGETSIZE64 */
 
 #include "util.h"
 #include "disk.h" 
+#include "snapshot.h"
+#include "filesystem.h"
+#include "region.h"
+#include "compressed.h"
+#include "url.h"
+
+// hex dump lines buffered by disk_cache_dump()
+#define DUMP_BUF_LINES	64
 
 extern json_object *json_root;
 
 unsigned disk_list_size;
 disk_t *disk_list;
 
-int disk_read(disk_t *disk, void *buffer, uint64_t block_nr, unsigned count)
+static disk_data_t *disk_cache_add(disk_t *disk, uint64_t chunk_nr);
+static int disk_read_cached(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count);
+static int disk_read_map(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count);
+static size_t disk_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset);
+static void disk_map(disk_t *disk);
+
+/*
+ * Read len bytes starting at offset.
+ *
+ * The range need not be aligned to chunks: partial chunks at either end are
+ * read in full and the relevant part is copied.
+ */
+int disk_read(disk_t *disk, void *buffer, uint64_t offset, size_t len)
 {
-  unsigned factor = disk->block_size / disk->chunk_size;
+  unsigned chunk_size = disk->chunk_size;
+  int err = 0;
+
+  // fprintf(stderr, "read: %llu - %zu\n", (unsigned long long) offset, len);
 
-  // fprintf(stderr, "read: %llu - %u (factor = %u)\n", (unsigned long long) block_nr, count, factor);
+  disk->stats.requests++;
 
-  count *= factor;
-  block_nr *= factor;
+  while(len && !err) {
+    uint64_t chunk_nr = offset / chunk_size;
+    unsigned chunk_ofs = offset % chunk_size;
+    size_t size;
 
-  for(unsigned u = 0; u < count; u++, block_nr++, buffer += disk->chunk_size) {
-    // fprintf(stderr, "read request: disk %u, addr %08"PRIx64"\n", disk->index, block_nr * disk->chunk_size);
-    if(!disk_cache_read(disk, buffer, block_nr)) {
-      int err = disk_read_single(disk, buffer, block_nr);
-      if(err) return err;
-      disk_cache_store(disk, buffer, block_nr);
+    if(!chunk_ofs && len >= chunk_size) {
+      size = len - len % chunk_size;
+      err = disk_read_cached(disk, buffer, chunk_nr, size / chunk_size);
+    }
+    else {
+      uint8_t tmp[DISK_MAX_CHUNK_SIZE];
+      size = chunk_size - chunk_ofs < len ? chunk_size - chunk_ofs : len;
+      err = disk_read_cached(disk, tmp, chunk_nr, 1);
+      memcpy(buffer, tmp + chunk_ofs, size);
     }
+
+    buffer += size;
+    offset += size;
+    len -= size;
+  }
+
+  return err;
+}
+
+
+/*
+ * View of the whole disk, with blocks of block_size.
+ */
+disk_view_t disk_view(disk_t *disk, unsigned block_size)
+{
+  return (disk_view_t) {
+    .disk = disk,
+    .size = disk->size_in_bytes,
+    .block_size = block_size,
+    .json = disk->json_disk
+  };
+}
+
+
+/*
+ * View starting at block block_nr of view, with blocks of block_size.
+ *
+ * The new view extends to the end of view. It adds its results to the
+ * same JSON object as view; set json to change this.
+ */
+disk_view_t disk_view_sub(disk_view_t *view, uint64_t block_nr, unsigned block_size)
+{
+  disk_view_t sub = *view;
+  uint64_t start = block_nr * view->block_size;
+
+  sub.offset += start;
+  sub.size = view->size > start ? view->size - start : 0;
+  sub.block_size = block_size;
+
+  return sub;
+}
+
+
+/*
+ * Read count blocks (of view->block_size) starting at block_nr of view.
+ */
+int disk_view_read(disk_view_t *view, void *buffer, uint64_t block_nr, unsigned count)
+{
+  return disk_read(view->disk, buffer, view->offset + block_nr * view->block_size, (size_t) count * view->block_size);
+}
+
+
+/*
+ * Like disk_view_read() but without adding data to the cache, see
+ * disk_read_nocache().
+ */
+int disk_view_read_nocache(disk_view_t *view, void *buffer, uint64_t block_nr, unsigned count)
+{
+  return disk_read_nocache(view->disk, buffer, view->offset + block_nr * view->block_size, (size_t) count * view->block_size);
+}
+
+
+/*
+ * Read count chunks starting at chunk_nr, using the cache.
+ */
+static int disk_read_cached(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count)
+{
+  if(disk->map) return disk_read_map(disk, buffer, chunk_nr, count);
+  if(disk->url) return url_read(disk, buffer, chunk_nr, count);
+
+  for(unsigned u = 0; u < count;) {
+    // fprintf(stderr, "read request: disk %u, addr %08"PRIx64"\n", disk->index, chunk_nr * disk->chunk_size);
+    if(disk_cache_read(disk, buffer, chunk_nr)) {
+      disk->stats.cache_hits++;
+      u++;
+      chunk_nr++;
+      buffer += disk->chunk_size;
+      continue;
+    }
+
+    // gather run of uncached chunks and read them in one go
+    unsigned run = 1;
+    while(u + run < count && !disk_cache_lookup(disk, chunk_nr + run)) run++;
+
+    disk->stats.cache_misses += run;
+
+    int err = disk_read_chunks(disk, buffer, chunk_nr, run);
+    if(err) return err;
+
+    u += run;
+    chunk_nr += run;
+    buffer += (size_t) run * disk->chunk_size;
   }
 
   return 0;
 }
 
 
-int disk_read_single(disk_t *disk, void *buffer, uint64_t block_nr)
+/*
+ * Read len bytes at offset from disk device.
+ *
+ * With O_DIRECT, the data go through an aligned bounce buffer, so neither
+ * buffer nor offset and len have to be aligned.
+ *
+ * Returns the number of bytes read (less than len on error or at the end
+ * of the device).
+ */
+static size_t disk_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset)
 {
-  if(disk->fd == -1) {
-    // fprintf(stderr, "cache miss: disk %u, addr %08"PRIx64"\n", disk->index, block_nr * disk->chunk_size);
-    memset(buffer, 0, disk->chunk_size);
+  size_t pos = 0;
+
+  if(disk->compressed) return compressed_pread(disk, buffer, len, offset);
+  if(disk->url) return url_pread(disk, buffer, len, offset);
+
+  if(!disk->direct) {
+    while(pos < len) {
+      ssize_t r = pread(disk->fd, buffer + pos, len - pos, offset + pos);
+      disk->stats.read_calls++;
+      if(r <= 0) break;
+      disk->stats.bytes_read += r;
+      pos += r;
+    }
+
+    return pos;
+  }
+
+  unsigned align = disk->dio_align;
+  uint64_t start = offset - offset % align;
+  uint64_t end = offset + len + align - 1;
+  end -= end % align;
+
+  if(end - start > disk->bounce_size) {
+    free(disk->bounce);
+    disk->bounce_size = end - start;
+    if(posix_memalign((void **) &disk->bounce, sysconf(_SC_PAGESIZE), disk->bounce_size)) {
+      disk->bounce = NULL;
+      disk->bounce_size = 0;
+
+      return 0;
+    }
+  }
+
+  size_t got = 0;
+
+  while(got < end - start) {
+    ssize_t r = pread(disk->fd, disk->bounce + got, end - start - got, start + got);
+    disk->stats.read_calls++;
+    if(r <= 0) break;
+    disk->stats.bytes_read += r;
+    got += r;
+  }
+
+  if(got > offset - start) {
+    pos = got - (offset - start) < len ? got - (offset - start) : len;
+    memcpy(buffer, disk->bounce + (offset - start), pos);
+  }
+
+  return pos;
+}
+
+
+/*
+ * Read count chunks starting at chunk_nr from disk and add them to the cache.
+ *
+ * Imported disks (fd == -1) read from the snapshot; everything not in it
+ * reads as zeros. Their cache entries point into the snapshot (missing
+ * chunks share its zero chunk), so nothing is allocated for them.
+ */
+int disk_read_chunks(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count)
+{
+  size_t len = (size_t) count * disk->chunk_size;
+  size_t pos = 0;
+
+  if(disk->snapshot) {
+    for(unsigned u = 0; u < count; u++, buffer += disk->chunk_size) {
+      uint8_t *data = snapshot_chunk(disk, chunk_nr + u);
+      if(data) {
+        disk->stats.bytes_read += disk->chunk_size;
+      }
+      else {
+        data = disk->snapshot->zero_chunk;
+      }
+      memcpy(buffer, data, disk->chunk_size);
+      disk_cache_add(disk, chunk_nr + u)->data = data;
+    }
 
     return 0;
   }
 
-  // fprintf(stderr, "read: %llu[%llu]\n", (unsigned long long) block_nr, (unsigned long long) disk->size);
+  if(disk->fd == -1 && !disk->url) {
+    // fprintf(stderr, "cache miss: disk %u, addr %08"PRIx64"\n", disk->index, chunk_nr * disk->chunk_size);
+    memset(buffer, 0, len);
+  }
+  else {
+    // fprintf(stderr, "read: %llu[%llu]\n", (unsigned long long) chunk_nr, (unsigned long long) count);
+
+    pos = disk_pread(disk, buffer, len, chunk_nr * disk->chunk_size);
+
+    // cache what we got completely
+    count = pos / disk->chunk_size;
+  }
+
+  for(unsigned u = 0; u < count; u++) {
+    disk_cache_store(disk, buffer + (size_t) u * disk->chunk_size, chunk_nr + u);
+  }
+
+  if((disk->fd != -1 || disk->url) && pos < len) {
+    fprintf(stderr, "error reading sector %"PRIu64"\n", chunk_nr + count);
 
-  off_t offset = block_nr * disk->chunk_size;
+    return 3;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Read len bytes starting at offset without adding them to the cache.
+ *
+ * This is for bulk data nobody needs later. If the disk data are going to
+ * be exported, or if there's nothing but the cache (imported disks), this
+ * is just disk_read().
+ */
+int disk_read_nocache(disk_t *disk, void *buffer, uint64_t offset, size_t len)
+{
+  size_t pos = 0;
 
-  if(lseek(disk->fd, offset, SEEK_SET) != offset) {
-    fprintf(stderr, "sector %"PRIu64" not found\n", block_nr);
+  if((disk->fd == -1 && !disk->url) || opt.export_file) return disk_read(disk, buffer, offset, len);
 
-    return 2;
+  disk->stats.requests++;
+
+  if(disk->map) {
+    if(offset < disk->size_in_bytes) {
+      pos = disk->size_in_bytes - offset < len ? disk->size_in_bytes - offset : len;
+      memcpy(buffer, disk->map + offset, pos);
+      disk->stats.bytes_read += pos;
+    }
+  }
+  else {
+    pos = disk_pread(disk, buffer, len, offset);
   }
 
-  if(read(disk->fd, buffer, disk->chunk_size) != disk->chunk_size) {
-    fprintf(stderr, "error reading sector %"PRIu64"\n", block_nr);
+  if(pos < len) {
+    fprintf(stderr, "error reading sector %"PRIu64"\n", (offset + pos) / disk->chunk_size);
 
     return 3;
   }
@@ -74,55 +321,163 @@ int disk_read_single(disk_t *disk, void *buffer, uint64_t block_nr)
 
 int disk_cache_read(disk_t *disk, void *buffer, uint64_t chunk_nr)
 {
-  for(disk_data_t *disk_data = disk->data; disk_data; disk_data = disk_data->next) {
-    if(disk_data->chunk_nr == chunk_nr) {
-      memcpy(buffer, disk_data->data, disk->chunk_size);
-      return 1;
+  disk_data_t *disk_data = disk_cache_lookup(disk, chunk_nr);
+
+  if(!disk_data) return 0;
+
+  memcpy(buffer, disk_data->data, disk->chunk_size);
+
+  return 1;
+}
+
+
+/*
+ * Hash slot for chunk_nr (Fibonacci hashing).
+ */
+static unsigned disk_cache_hash(disk_cache_t *cache, uint64_t chunk_nr)
+{
+  return (chunk_nr * 0x9e3779b97f4a7c15ull) >> (64 - cache->hash_bits);
+}
+
+
+/*
+ * Add list entry idx to hash table.
+ *
+ * Uses linear probing; the table is kept at most half full.
+ */
+static void disk_cache_hash_add(disk_cache_t *cache, unsigned idx)
+{
+  unsigned mask = (1u << cache->hash_bits) - 1;
+  unsigned slot = disk_cache_hash(cache, cache->list[idx].chunk_nr);
+
+  while(cache->hash[slot]) slot = (slot + 1) & mask;
+
+  cache->hash[slot] = idx + 1;
+}
+
+
+/*
+ * Read count chunks starting at chunk_nr directly from the file mapping.
+ *
+ * The chunks are added to the cache (pointing into the mapping) only to
+ * remember them for disk_export().
+ */
+static int disk_read_map(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count)
+{
+  uint64_t chunks = disk->size_in_bytes / disk->chunk_size;
+  unsigned avail = chunk_nr >= chunks ? 0 : chunks - chunk_nr < count ? chunks - chunk_nr : count;
+
+  memcpy(buffer, disk->map + chunk_nr * disk->chunk_size, (size_t) avail * disk->chunk_size);
+
+  for(unsigned u = 0; u < avail; u++) {
+    if(disk_cache_lookup(disk, chunk_nr + u)) {
+      disk->stats.cache_hits++;
     }
+    else {
+      disk_cache_add(disk, chunk_nr + u)->data = disk->map + (chunk_nr + u) * disk->chunk_size;
+      disk->stats.cache_misses++;
+      disk->stats.bytes_read += disk->chunk_size;
+    }
+  }
+
+  if(avail < count) {
+    fprintf(stderr, "error reading sector %"PRIu64"\n", chunk_nr + avail);
+
+    return 3;
   }
 
   return 0;
 }
 
 
+/*
+ * Add a new, empty cache entry for chunk_nr.
+ *
+ * The caller must set the data pointer.
+ */
+static disk_data_t *disk_cache_add(disk_t *disk, uint64_t chunk_nr)
+{
+  disk_cache_t *cache = &disk->cache;
+
+  if(cache->size == cache->max) {
+    cache->max = cache->max ? 2 * cache->max : 256;
+    cache->list = reallocarray(cache->list, cache->max, sizeof *cache->list);
+    cache->order = reallocarray(cache->order, cache->max, sizeof *cache->order);
+  }
+
+  if(2 * (cache->size + 1) > (1u << cache->hash_bits)) {
+    free(cache->hash);
+    cache->hash_bits = cache->hash_bits ? cache->hash_bits + 1 : 9;
+    cache->hash = calloc(1u << cache->hash_bits, sizeof *cache->hash);
+    for(unsigned u = 0; u < cache->size; u++) disk_cache_hash_add(cache, u);
+  }
+
+  unsigned idx = cache->size++;
+  disk_data_t *disk_data = cache->list + idx;
+
+  disk_data->chunk_nr = chunk_nr;
+  disk_data->data = NULL;
+
+  disk_cache_hash_add(cache, idx);
+
+  // keep sort order as long as chunks come in ascending order
+  if(
+    cache->order_size == idx &&
+    (!idx || cache->list[cache->order[idx - 1]].chunk_nr < chunk_nr)
+  ) {
+    cache->order[cache->order_size++] = idx;
+  }
+
+  return disk_data;
+}
+
+
 void disk_cache_store(disk_t *disk, void *buffer, uint64_t chunk_nr)
 {
+  disk_data_t *disk_data;
+
   // fprintf(stderr, "cache store: disk %u, addr %08"PRIx64"\n", disk->index, chunk_nr * disk->chunk_size);
-  disk_data_t *disk_data = calloc(1, sizeof *disk_data);
 
-  disk_data->chunk_nr = chunk_nr;
-  disk_data->data = malloc(disk->chunk_size);
-  memcpy(disk_data->data, buffer, disk->chunk_size);
+  if(!(disk_data = disk_cache_lookup(disk, chunk_nr))) {
+    disk_data = disk_cache_add(disk, chunk_nr);
+    disk_data->data = malloc(disk->chunk_size);
+  }
+  else {
+    // chunk changed, have disk_to_fd() rewrite everything
+    disk->cache_fd_chunks = 0;
+  }
 
-  disk_data->next = disk->data;
-  disk->data = disk_data;
+  memcpy(disk_data->data, buffer, disk->chunk_size);
 }
 
 
-int disk_export(disk_t *disk, char *file_name)
+/*
+ * Append cached disk data to file_name ("-" means stdout).
+ *
+ * The default is the binary snapshot format, text selects the hex dump.
+ */
+int disk_export(disk_t *disk, char *file_name, int text)
 {
   FILE *f = stdout;
 
+  if(!text) return snapshot_export(disk, file_name);
+
   if(strcmp(file_name, "-")) {
     f = fopen(file_name, "a");
     if(!f) {
       perror(file_name);
       return 1;
     }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
   }
 
   fprintf(f, "# disk %u, size = %"PRIu64"\n", disk->index, disk->size_in_bytes);
 
-  uint64_t chunk_nr = 0;
-  disk_data_t *disk_data;
+  unsigned *order = disk_cache_sorted(disk);
 
-  do {
-    disk_data = disk_cache_search(disk, &chunk_nr);
-    if(disk_data) {
-      disk_cache_dump(disk, disk_data, f);
-    }
+  for(unsigned u = 0; u < disk->cache.size; u++) {
+    disk_cache_dump(disk, disk->cache.list + order[u], f);
   }
-  while(chunk_nr != UINT64_MAX);
 
   if(f != stdout) fclose(f);
 
@@ -130,36 +485,62 @@ int disk_export(disk_t *disk, char *file_name)
 }
 
 
-int disk_to_fd(disk_t *disk, uint64_t offset)
+/*
+ * Get a file descriptor with the cached disk data.
+ *
+ * This is for disks without a real device (imported disks) or opened
+ * with O_DIRECT. The memfd is
+ * created once per disk; later calls only add newly cached chunks. Chunks
+ * are at their original offsets, the rest reads as zeros.
+ *
+ * The descriptor belongs to the disk, don't close it.
+ *
+ * Returns -1 on failure.
+ */
+int disk_to_fd(disk_t *disk)
 {
-  uint64_t chunk_nr = 0;
-  disk_data_t *disk_data;
+  if(disk->cache_fd == -1) return -1;
 
-  int fd = syscall(SYS_memfd_create, "", 0);
+  if(!disk->cache_fd) {
+    int fd = syscall(SYS_memfd_create, "", 0);
 
-  if(fd == -1) return 0;
+    if(fd == -1 || ftruncate(fd, disk->size_in_bytes)) {
+      if(fd != -1) close(fd);
+      disk->cache_fd = -1;
 
-  do {
-    disk_data = disk_cache_search(disk, &chunk_nr);
-    if(disk_data) {
-      if(disk_data->chunk_nr * disk->chunk_size >= offset) {
-        lseek(fd, disk_data->chunk_nr * disk->chunk_size - offset, SEEK_SET);
-        write(fd, disk_data->data, disk->chunk_size);
-      }
+      return -1;
     }
+
+    disk->cache_fd = fd;
+    disk->cache_fd_chunks = 0;
+    disk->stats.fd_created++;
   }
-  while(chunk_nr != UINT64_MAX);
 
-  lseek(fd, 0, SEEK_SET);
+  // cache list is in insertion order, so only the tail is new
+  for(; disk->cache_fd_chunks < disk->cache.size; disk->cache_fd_chunks++) {
+    disk_data_t *disk_data = disk->cache.list + disk->cache_fd_chunks;
+    pwrite(disk->cache_fd, disk_data->data, disk->chunk_size, disk_data->chunk_nr * disk->chunk_size);
+    disk->stats.fd_writes++;
+    disk->stats.fd_bytes += disk->chunk_size;
+  }
 
-  return fd;
+  return disk->cache_fd;
 }
 
 
+/*
+ * Hex dump chunk, 16 bytes per line. All-zero lines are skipped.
+ *
+ * The lines are put together in a buffer and written in one go.
+ */
 void disk_cache_dump(disk_t *disk, disk_data_t *disk_data, FILE *file)
 {
+  static const char hex[] = "0123456789abcdef";
   uint8_t all_zeros[16] = {};
   uint8_t *data = disk_data->data;
+  // lines of address (at most 16 digits) + 16 * 3 + 2 + 16 + newline;
+  // the buffer is written out whenever it's full
+  char buf[DUMP_BUF_LINES * 84], *s = buf;
 
   uint64_t max_addr = disk->size_in_bytes - 1;
   unsigned address_digits = 0;
@@ -167,99 +548,466 @@ void disk_cache_dump(disk_t *disk, disk_data_t *disk_data, FILE *file)
   if(address_digits < 4) address_digits = 4;
 
   for(unsigned u = 0; u < disk->chunk_size; u += 16) {
-    if(memcmp(data + u, &all_zeros, 16)) {
-      fprintf(file, "%0*"PRIx64" ", address_digits, disk_data->chunk_nr * disk->chunk_size + u);
-      for(unsigned u1 = 0; u1 < 16; u1++) {
-        fprintf(file, " %02x", data[u + u1]);
-      }
-      fprintf(file, "  ");
-      for(unsigned u1 = 0; u1 < 16; u1++) {
-        fprintf(file, "%c", data[u + u1] >= 32 && data[u + u1] < 0x7f ? data[u + u1] : '.');
-      }
-      fprintf(file, "\n");
+    uint8_t *line = data + u;
+    if(!memcmp(line, &all_zeros, 16)) continue;
+
+    uint64_t addr = disk_data->chunk_nr * disk->chunk_size + u;
+    unsigned digits = address_digits;
+    while(digits < 16 && addr >> (4 * digits)) digits++;
+
+    while(digits--) *s++ = hex[(addr >> (4 * digits)) & 0xf];
+    *s++ = ' ';
+
+    for(unsigned u1 = 0; u1 < 16; u1++) {
+      *s++ = ' ';
+      *s++ = hex[line[u1] >> 4];
+      *s++ = hex[line[u1] & 0xf];
+    }
+
+    *s++ = ' ';
+    *s++ = ' ';
+
+    for(unsigned u1 = 0; u1 < 16; u1++) {
+      *s++ = line[u1] >= 32 && line[u1] < 0x7f ? line[u1] : '.';
+    }
+
+    *s++ = '\n';
+
+    if(s + 84 > buf + sizeof buf) {
+      fwrite(buf, s - buf, 1, file);
+      s = buf;
     }
   }
+
+  if(s != buf) fwrite(buf, s - buf, 1, file);
 }
 
 
-disk_data_t *disk_cache_search(disk_t *disk, uint64_t *chunk_nr)
+disk_data_t *disk_cache_lookup(disk_t *disk, uint64_t chunk_nr)
 {
-  disk_data_t *disk_data_found = NULL;
-  uint64_t next_chunk_nr = UINT64_MAX;
+  disk_cache_t *cache = &disk->cache;
 
-  if(*chunk_nr == next_chunk_nr) return NULL;
+  if(!cache->size) return NULL;
 
-  for(disk_data_t *disk_data = disk->data; disk_data; disk_data = disk_data->next) {
-    if(disk_data->chunk_nr == *chunk_nr) {
-      disk_data_found = disk_data;
-    }
-    if(disk_data->chunk_nr > *chunk_nr && disk_data->chunk_nr < next_chunk_nr) {
-      next_chunk_nr = disk_data->chunk_nr;
-    }
+  unsigned mask = (1u << cache->hash_bits) - 1;
+
+  for(unsigned slot = disk_cache_hash(cache, chunk_nr); cache->hash[slot]; slot = (slot + 1) & mask) {
+    disk_data_t *disk_data = cache->list + cache->hash[slot] - 1;
+    if(disk_data->chunk_nr == chunk_nr) return disk_data;
   }
 
-  *chunk_nr = next_chunk_nr;
+  return NULL;
+}
+
+
+static int disk_cache_cmp(const void *a, const void *b, void *list)
+{
+  uint64_t nr_a = ((disk_data_t *) list)[*(const unsigned *) a].chunk_nr;
+  uint64_t nr_b = ((disk_data_t *) list)[*(const unsigned *) b].chunk_nr;
 
-  return disk_data_found;
+  return nr_a < nr_b ? -1 : nr_a > nr_b;
 }
 
 
-void disk_add_to_list(disk_t *disk)
+/*
+ * Get cached chunks sorted by chunk number.
+ *
+ * Returns an array of disk->cache.size indices into disk->cache.list.
+ * The array stays valid until the next disk_cache_store() call.
+ */
+unsigned *disk_cache_sorted(disk_t *disk)
 {
-  json_object *json;
+  disk_cache_t *cache = &disk->cache;
 
+  if(cache->order_size != cache->size) {
+    for(unsigned u = 0; u < cache->size; u++) cache->order[u] = u;
+    qsort_r(cache->order, cache->size, sizeof *cache->order, disk_cache_cmp, cache->list);
+    cache->order_size = cache->size;
+  }
+
+  return cache->order;
+}
+
+
+void disk_add_to_list(disk_t *disk)
+{
   disk_list = reallocarray(disk_list, disk_list_size + 1, sizeof *disk_list);
   disk_list[disk_list_size] = *disk;
   disk_list[disk_list_size].index = disk_list_size;
-  disk_list[disk_list_size].json_disk =
-    disk_list[disk_list_size].json_current = json = json_object_new_object();
-  json_object_array_add(json_root, json);
+  disk_json_new(disk_list + disk_list_size);
+  json_object_array_add(json_root, disk_list[disk_list_size].json_disk);
 
   disk_list_size++;
 
   log_info("%s: %"PRIu64" bytes\n", disk->name, disk->size_in_bytes);
+}
+
 
+/*
+ * Create JSON object for disk, with the device details.
+ */
+void disk_json_new(disk_t *disk)
+{
+  json_object *json = disk->json_disk = json_object_new_object();
   json_object *json_device = json_object_new_object();
 
   json_object_object_add(json, "device", json_device);
   json_object_object_add(json_device, "file_name", json_object_new_string(disk->name));
-  json_object_object_add(json_device, "block_size", json_object_new_int(disk->block_size));
-  json_object_object_add(json_device, "size", json_object_new_int64(disk->size_in_bytes / disk->block_size));
+  json_object_object_add(json_device, "block_size", json_object_new_int(disk->sector_size));
+  json_object_object_add(json_device, "size", json_object_new_int64(disk->size_in_bytes / disk->sector_size));
 }
 
 
-void disk_init(char *file_name)
+/*
+ * Open disk device or image file_name.
+ *
+ * For block devices, block_size is the logical block size and the cache
+ * works with physical blocks. With opt.direct, the disk is opened with
+ * O_DIRECT (if supported), bypassing the page cache. http and https URLs
+ * are read with range requests, see url.c.
+ *
+ * Returns 0 on success, else an errno value.
+ */
+int disk_open(disk_t *disk, char *file_name)
 {
   struct stat sbuf;
-  disk_t disk = { .chunk_size = 512, .block_size = 512 };
 
-  disk.fd = open(file_name, O_RDONLY | O_LARGEFILE);
+  *disk = (disk_t) { .chunk_size = 512, .sector_size = 512 };
 
-  if(disk.fd == -1) {
-    perror(file_name);
-    exit(1);
+  disk->fd = -1;
+
+  if(!strncmp(file_name, "http://", sizeof "http://" - 1) || !strncmp(file_name, "https://", sizeof "https://" - 1)) {
+    disk->name = strdup(file_name);
+
+    return url_open(disk);
+  }
+
+  if(opt.direct) {
+    disk->fd = open(file_name, O_RDONLY | O_LARGEFILE | O_DIRECT);
+    // not all file systems support O_DIRECT
+    if(disk->fd == -1 && errno != EINVAL) return errno;
+    disk->direct = disk->fd != -1;
+  }
+
+  if(disk->fd == -1) disk->fd = open(file_name, O_RDONLY | O_LARGEFILE);
+
+  if(disk->fd == -1) return errno;
+
+  disk->name = strdup(file_name);
+
+  if(fstat(disk->fd, &sbuf)) sbuf = (struct stat) { };
+
+  disk->size_in_bytes = sbuf.st_size;
+  if(!disk->size_in_bytes && ioctl(disk->fd, BLKGETSIZE64, &disk->size_in_bytes)) disk->size_in_bytes = 0;
+
+  // 4k for files - O_DIRECT needs at least fs block alignment
+  disk->dio_align = 4096;
+
+  if(S_ISBLK(sbuf.st_mode)) {
+    int logical = 0;
+    unsigned physical = 0;
+
+    if(!ioctl(disk->fd, BLKSSZGET, &logical) && logical >= 512 && logical <= DISK_MAX_CHUNK_SIZE && !(logical & (logical - 1))) {
+      disk->sector_size = disk->chunk_size = disk->dio_align = logical;
+    }
+
+    if(
+      !ioctl(disk->fd, BLKPBSZGET, &physical) && !(physical & (physical - 1)) &&
+      physical > disk->chunk_size && physical <= DISK_MAX_CHUNK_SIZE
+    ) {
+      disk->chunk_size = physical;
+    }
+  }
+
+  if(S_ISREG(sbuf.st_mode) && !compressed_open(disk) && !disk->direct) disk_map(disk);
+
+  return 0;
+}
+
+
+/*
+ * Free all resources of a disk opened with disk_open().
+ *
+ * The JSON object is left alone.
+ */
+void disk_free(disk_t *disk)
+{
+  if(disk->fd >= 0) close(disk->fd);
+  if(disk->cache_fd > 0) close(disk->cache_fd);
+
+  if(disk->map) {
+    munmap(disk->map, disk->size_in_bytes);
+  }
+  else if(!disk->snapshot) {
+    // data of mapped and snapshot disks is not ours, see disk_read_chunks()
+    for(unsigned u = 0; u < disk->cache.size; u++) free(disk->cache.list[u].data);
+  }
+
+  free(disk->bounce);
+
+  free(disk->cache.list);
+  free(disk->cache.hash);
+  free(disk->cache.order);
+
+  for(unsigned u = 0; u < disk->iso.size; u++) free(disk->iso.files[u].name);
+  free(disk->iso.files);
+  free(disk->iso.max_end);
+  free(disk->iso.name_buf);
+  fs_probe_free(disk);
+  region_free(disk);
+  compressed_free(disk);
+  snapshot_free(disk);
+  url_free(disk);
+
+  free(disk->name);
+
+  *disk = (disk_t) { .fd = -1 };
+}
+
+
+/*
+ * Print I/O statistics and analyzer run times.
+ */
+void disk_dump_stats(disk_t *disk)
+{
+  disk_stats_t *stats = &disk->stats;
+  json_object *json_stats = json_object_new_object();
+  json_object *json_cache = json_object_new_object();
+  json_object *json_read = json_object_new_object();
+  json_object *json_fd = json_object_new_object();
+  json_object *json_time = json_object_new_object();
+
+  json_object_object_add(disk->json_disk, "stats", json_stats);
+
+  log_info(SEP "\nstats:\n");
+
+  json_object_object_add(json_stats, "requests", json_object_new_int64(stats->requests));
+  log_info("  requests: %"PRIu64"\n", stats->requests);
+
+  json_object_object_add(json_stats, "cache", json_cache);
+  json_object_object_add(json_cache, "chunk_size", json_object_new_int(disk->chunk_size));
+  json_object_object_add(json_cache, "hits", json_object_new_int64(stats->cache_hits));
+  json_object_object_add(json_cache, "misses", json_object_new_int64(stats->cache_misses));
+  json_object_object_add(json_cache, "chunks", json_object_new_int64(disk->cache.size));
+  log_info(
+    "  cache: %"PRIu64" hits, %"PRIu64" misses, %u chunks (chunk size %u)\n",
+    stats->cache_hits, stats->cache_misses, disk->cache.size, disk->chunk_size
+  );
+
+  json_object_object_add(json_stats, "read", json_read);
+  json_object_object_add(json_read, "calls", json_object_new_int64(stats->read_calls));
+  json_object_object_add(json_read, "bytes", json_object_new_int64(stats->bytes_read));
+  json_object_object_add(json_read, "mapped", json_object_new_boolean(disk->map != NULL));
+  json_object_object_add(json_read, "direct", json_object_new_boolean(disk->direct));
+  log_info(
+    "  read: %"PRIu64" calls, %"PRIu64" bytes%s\n",
+    stats->read_calls, stats->bytes_read, disk->map ? " (mapped)" : disk->direct ? " (O_DIRECT)" : ""
+  );
+
+  if(disk->compressed) {
+    compressed_t *c = disk->compressed;
+    json_object *json_compressed = json_object_new_object();
+
+    json_object_object_add(json_stats, "compressed", json_compressed);
+    json_object_object_add(json_compressed, "type", json_object_new_string(c->type == compressed_xz ? "xz" : "zstd"));
+    json_object_object_add(json_compressed, "sequential", json_object_new_boolean(c->sequential));
+    json_object_object_add(json_compressed, "frames", json_object_new_int64(c->frame_count));
+    json_object_object_add(json_compressed, "decoded", json_object_new_int64(c->decoded));
+    json_object_object_add(json_compressed, "restarts", json_object_new_int64(c->restarts));
+    log_info(
+      "  %s: %u frames, %"PRIu64" decoded, %"PRIu64" restarts%s\n",
+      c->type == compressed_xz ? "xz" : "zstd", c->frame_count, c->decoded, c->restarts,
+      c->sequential ? " (sequential)" : ""
+    );
   }
 
-  disk.name = strdup(file_name);
+  if(disk->url) {
+    json_object *json_url = json_object_new_object();
+
+    json_object_object_add(json_stats, "http", json_url);
+    json_object_object_add(json_url, "requests", json_object_new_int64(disk->url->requests));
+    json_object_object_add(json_url, "merged", json_object_new_int64(disk->url->merged));
+    json_object_object_add(json_url, "parallel_max", json_object_new_int(disk->url->parallel_max));
+    log_info(
+      "  http: %"PRIu64" range requests, %"PRIu64" misses merged, max. %u in parallel\n",
+      disk->url->requests, disk->url->merged, disk->url->parallel_max
+    );
+  }
+
+  json_object_object_add(json_stats, "memfd", json_fd);
+  json_object_object_add(json_fd, "created", json_object_new_int64(stats->fd_created));
+  json_object_object_add(json_fd, "writes", json_object_new_int64(stats->fd_writes));
+  json_object_object_add(json_fd, "bytes", json_object_new_int64(stats->fd_bytes));
+  log_info(
+    "  memfd: %"PRIu64" created, %"PRIu64" writes, %"PRIu64" bytes\n",
+    stats->fd_created, stats->fd_writes, stats->fd_bytes
+  );
+
+  json_object_object_add(json_stats, "probes", json_object_new_int64(stats->probes));
+  json_object_object_add(json_stats, "probes_cached", json_object_new_int64(stats->probes_cached));
+  log_info("  blkid probes: %"PRIu64" (%"PRIu64" cached)\n", stats->probes, stats->probes_cached);
+
+  json_object_object_add(json_stats, "time_us", json_time);
+  log_info("  time:\n");
+  for(unsigned u = 0; u < stats->timers; u++) {
+    json_object_object_add(json_time, stats->timer[u].name, json_object_new_int64(stats->timer[u].usec));
+    log_info("    %s: %"PRIu64" us\n", stats->timer[u].name, stats->timer[u].usec);
+  }
+}
 
-  if(!fstat(disk.fd, &sbuf)) disk.size_in_bytes = sbuf.st_size;
-  if(!disk.size_in_bytes && ioctl(disk.fd, BLKGETSIZE64, &disk.size_in_bytes)) disk.size_in_bytes = 0;
+
+void disk_init(char *file_name)
+{
+  disk_t disk;
+  int err = disk_open(&disk, file_name);
+
+  if(err) {
+    fprintf(stderr, "%s: %s\n", file_name, strerror(err));
+    exit(1);
+  }
 
   disk_add_to_list(&disk);
 }
 
 
+/*
+ * Map disk image file into memory.
+ *
+ * disk_read() is then served directly from the mapping. Only done for
+ * regular files; on failure, the regular read() + cache path is used.
+ */
+static void disk_map(disk_t *disk)
+{
+  if(!disk->size_in_bytes || disk->size_in_bytes != (size_t) disk->size_in_bytes) return;
+
+  void *map = mmap(NULL, disk->size_in_bytes, PROT_READ, MAP_SHARED, disk->fd, 0);
+
+  if(map == MAP_FAILED) return;
+
+  disk->map = map;
+
+  // we're jumping around a lot, except for the well-known metadata areas:
+  // volume descriptors and fs superblocks at the start, backup gpt at the end
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint64_t head = 68 * 1024;
+  uint64_t tail = 33 * 4096;
+
+  madvise(map, disk->size_in_bytes, MADV_RANDOM);
+
+  if(head > disk->size_in_bytes) head = disk->size_in_bytes;
+  madvise(map, head, MADV_WILLNEED);
+
+  if(tail < disk->size_in_bytes) {
+    uint64_t start = (disk->size_in_bytes - tail) & ~(uint64_t) (page_size - 1);
+    madvise(disk->map + start, disk->size_in_bytes - start, MADV_WILLNEED);
+  }
+}
+
+
+// hex digit values, -1 = no hex digit
+static const signed char hex_value[256] = {
+  [0 ... 255] = -1,
+  ['0'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+  ['A'] = 10, 11, 12, 13, 14, 15,
+  ['a'] = 10, 11, 12, 13, 14, 15
+};
+
+
+/*
+ * Parse a hex dump line as written by disk_cache_dump().
+ *
+ * Lines in exactly that layout are decoded directly, anything else is
+ * left to sscanf().
+ *
+ * Returns 1 on success, else 0.
+ */
+static int disk_parse_line(char *line, uint64_t *addr, uint8_t *data)
+{
+  unsigned char *s = (unsigned char *) line;
+  uint64_t val = 0;
+  unsigned u;
+  int d, bad = 0;
+
+  for(u = 0; u < 16 && (d = hex_value[*s]) >= 0; u++, s++) val = (val << 4) + d;
+
+  if(u && *s++ == ' ') {
+    // check the whole line at once, branches don't go well with random data
+    for(u = 0; u < 16; u++, s += 3) {
+      if(!s[0] || !s[1] || !s[2]) break;
+      int hi = hex_value[s[1]], lo = hex_value[s[2]];
+      // hex_value is negative for non-digits
+      bad |= (s[0] ^ ' ') | (hi | lo) >> 4;
+      data[u] = (hi << 4) + lo;
+    }
+
+    if(u == 16 && !bad && hex_value[*s] < 0) {
+      *addr = val;
+
+      return 1;
+    }
+  }
+
+  return sscanf(line,
+    "%"SCNx64" %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx",
+    addr,
+    data, data + 1, data + 2, data + 3,
+    data + 4, data + 5, data + 6, data + 7,
+    data + 8, data + 9, data + 10, data + 11,
+    data + 12, data + 13, data + 14, data + 15
+  ) == 17;
+}
+
+
+/*
+ * Import disk data from file_name.
+ *
+ * Both binary snapshots and hex dumps are accepted.
+ */
 void disk_import(char *file_name)
 {
-  FILE *file = fopen(file_name, "r");
+  struct stat sbuf;
+  int fd = open(file_name, O_RDONLY | O_LARGEFILE);
 
-  if(!file) {
+  if(fd == -1) {
     perror(file_name);
     exit(1);
   }
 
-  char *line = NULL;
-  size_t line_len = 0;
+  int is_file = !fstat(fd, &sbuf) && S_ISREG(sbuf.st_mode);
+
+  // binary snapshots are used directly from the file mapping
+  if(is_file && sbuf.st_size) {
+    void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(map != MAP_FAILED) {
+      if(snapshot_import(file_name, map, sbuf.st_size)) {
+        close(fd);
+
+        return;
+      }
+      munmap(map, sbuf.st_size);
+    }
+  }
+
+  // read everything at once; lines are split in place
+  size_t text_max = (is_file ? sbuf.st_size : 0) + 2;
+  size_t text_size = 0;
+  char *text = malloc(text_max);
+  ssize_t r;
+
+  while((r = read(fd, text + text_size, text_max - text_size - 1)) > 0) {
+    text_size += r;
+    if(text_size + 1 == text_max) text = realloc(text, text_max = 2 * text_max + (1 << 20));
+  }
+
+  close(fd);
+
+  // not a file, but might still be a binary snapshot
+  if(snapshot_import(file_name, (uint8_t *) text, text_size)) return;
+
+  text[text_size] = 0;
+
+  char *line, *next;
   unsigned line_nr = 0;
 
   disk_t disk = { .fd = -1 };
@@ -267,13 +1015,19 @@ void disk_import(char *file_name)
   uint8_t chunk[512];
   uint64_t current_chunk_nr = UINT64_MAX;
 
-  while(getline(&line, &line_len, file) > 0) {
+  for(line = text; line < text + text_size; line = next) {
+    if((next = memchr(line, '\n', text + text_size - line))) {
+      *next++ = 0;
+    }
+    else {
+      next = text + text_size;
+    }
     line_nr++;
     unsigned index;
     uint64_t size;
     uint64_t addr;
     uint8_t line_data[16];
-    if(sscanf(line, "# disk %u, size = %"SCNu64"", &index, &size) == 2) {
+    if(*line == '#' && sscanf(line, "# disk %u, size = %"SCNu64"", &index, &size) == 2) {
       if(disk.name) {
         if(current_chunk_nr != UINT64_MAX) disk_cache_store(&disk, chunk, current_chunk_nr);
         disk_add_to_list(&disk);
@@ -282,17 +1036,10 @@ void disk_import(char *file_name)
       }
       asprintf(&disk.name, "%s#%u", file_name, index);
       disk.size_in_bytes = size;
-      disk.chunk_size = disk.block_size = 512;
+      disk.chunk_size = disk.sector_size = 512;
     }
     else if(
-      sscanf(line,
-        "%"SCNx64" %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx %hhx",
-        &addr,
-        line_data, line_data + 1, line_data + 2, line_data + 3,
-        line_data + 4, line_data + 5, line_data + 6, line_data + 7,
-        line_data + 8, line_data + 9, line_data + 10, line_data + 11,
-        line_data + 12, line_data + 13, line_data + 14, line_data + 15
-      ) == 17 &&
+      disk_parse_line(line, &addr, line_data) &&
       !(addr & 0xf) &&
       addr <= disk.size_in_bytes + 16
     ) {
@@ -312,7 +1059,7 @@ void disk_import(char *file_name)
     }
   }
 
-  free(line);
+  free(text);
 
   if(disk.name) {
     if(current_chunk_nr != UINT64_MAX) disk_cache_store(&disk, chunk, current_chunk_nr);
@@ -1,12 +1,45 @@
 #include <json-c/json.h>
 
-typedef struct disk_data_s {
-  struct disk_data_s *next;
+typedef struct {
   uint64_t chunk_nr;
   uint8_t *data;
 } disk_data_t;
 
 typedef struct {
+  unsigned size;		// cached chunks
+  unsigned max;			// allocated entries in list and order
+  disk_data_t *list;		// cached chunks, in insertion order
+  unsigned hash_bits;		// hash table has (1 << hash_bits) slots
+  unsigned *hash;		// index into list + 1; 0 = free slot
+  unsigned *order;		// indices into list, sorted by chunk_nr
+  unsigned order_size;		// valid entries in order
+} disk_cache_t;
+
+// largest chunk size (for devices with large physical blocks)
+#define DISK_MAX_CHUNK_SIZE	(64 * 1024)
+
+// analyzers with run time statistics, see analyze_disk()
+#define DISK_STATS_TIMERS	8
+
+typedef struct {
+  uint64_t requests;		// disk_read() calls
+  uint64_t cache_hits;		// chunks found in cache
+  uint64_t cache_misses;	// chunks not in cache
+  uint64_t read_calls;		// read syscalls (HTTP requests)
+  uint64_t bytes_read;		// bytes read from device, file mapping, or snapshot (compressed)
+  uint64_t fd_created;		// memfds created by disk_to_fd()
+  uint64_t fd_writes;		// chunks written to memfd
+  uint64_t fd_bytes;		// bytes written to memfd
+  uint64_t probes;		// libblkid probes
+  uint64_t probes_cached;	// fs probes answered from disk->probe
+  unsigned timers;		// entries in timer
+  struct {
+    char *name;
+    uint64_t usec;		// wall clock time
+  } timer[DISK_STATS_TIMERS];
+} disk_stats_t;
+
+typedef struct disk_s {
   char *name;
   int fd;
   unsigned index;
@@ -14,28 +47,86 @@ typedef struct {
   unsigned sectors;
   unsigned cylinders;
   uint64_t size_in_bytes;
-  unsigned chunk_size;
-  unsigned block_size;
+  unsigned chunk_size;		// cache unit; physical block size for devices
+  unsigned sector_size;		// logical block size of device
   unsigned grub_used:1;
   unsigned isolinux_used:1;
-  disk_data_t *data;
+  unsigned direct:1;		// opened with O_DIRECT
+  unsigned json_only:1;		// no text output (library use), see parti_open()
+  unsigned dio_align;		// O_DIRECT offset, size, and buffer alignment
+  uint8_t *bounce;		// aligned buffer for O_DIRECT reads
+  size_t bounce_size;
+  uint8_t *map;			// disk image mapped into memory (or NULL)
+  int cache_fd;			// memfd with cached chunks, see disk_to_fd()
+  unsigned cache_fd_chunks;	// cache entries already written to cache_fd
+  disk_cache_t cache;
+  struct snapshot_s *snapshot;	// imported binary snapshot (or NULL)
+  struct compressed_s *compressed;	// xz or zstd compressed image (or NULL)
+  struct url_s *url;		// image on a web server (or NULL)
+  struct {
+    struct iso_file_s *files;	// iso9660 files, sorted by start block
+    unsigned *max_end;		// max end block of files[0..i]
+    unsigned size;		// entries in files
+    unsigned max;		// allocated entries in files
+    char *name_buf;		// see iso_block_to_name()
+    size_t name_buf_size;
+    unsigned read:1;		// file list has been read
+  } iso;
+  struct {
+    struct fs_probe_s *list;	// fs_probe() results, one per offset
+    unsigned size;		// entries in list
+    unsigned max;		// allocated entries in list
+  } probe;
+  struct {
+    struct region_s *list;	// disk areas claimed by some structure, see region_add()
+    unsigned size;		// entries in list
+    unsigned max;		// allocated entries in list
+    unsigned enabled:1;		// collect regions (for dump_lba_map())
+  } regions;
+  disk_stats_t stats;
   json_object *json_disk;
-  json_object *json_current;
 } disk_t;
 
+/*
+ * A region of a disk, read in units of block_size.
+ *
+ * Views don't own any data: all reads go through the cache of the
+ * underlying disk. Analyzers get a view instead of the disk so they can
+ * use their own block size and be applied to parts of the disk (e.g. a
+ * partition or an El Torito boot image) without changing the disk.
+ */
+typedef struct {
+  disk_t *disk;			// disk the data come from
+  uint64_t offset;		// view start on disk, in bytes
+  uint64_t size;		// view size in bytes (0 = unknown)
+  unsigned block_size;		// unit for disk_view_read()
+  json_object *json;		// JSON object to add results to
+} disk_view_t;
+
 extern unsigned disk_list_size;
 extern disk_t *disk_list;
 
-int disk_read(disk_t *disk, void *buf, uint64_t sector, unsigned cnt);
-int disk_read_single(disk_t *disk, void *buffer, uint64_t block_nr);
+int disk_read(disk_t *disk, void *buffer, uint64_t offset, size_t len);
+int disk_read_chunks(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count);
+int disk_read_nocache(disk_t *disk, void *buffer, uint64_t offset, size_t len);
+
+disk_view_t disk_view(disk_t *disk, unsigned block_size);
+disk_view_t disk_view_sub(disk_view_t *view, uint64_t block_nr, unsigned block_size);
+int disk_view_read(disk_view_t *view, void *buffer, uint64_t block_nr, unsigned count);
+int disk_view_read_nocache(disk_view_t *view, void *buffer, uint64_t block_nr, unsigned count);
 
 int disk_cache_read(disk_t *disk, void *buffer, uint64_t chunk_nr);
 void disk_cache_dump(disk_t *disk, disk_data_t *disk_data, FILE *file);
 void disk_cache_store(disk_t *disk, void *buffer, uint64_t chunk_nr);
-disk_data_t *disk_cache_search(disk_t *disk, uint64_t *chunk_nr);
+disk_data_t *disk_cache_lookup(disk_t *disk, uint64_t chunk_nr);
+unsigned *disk_cache_sorted(disk_t *disk);
 
-int disk_export(disk_t *disk, char *file_name);
-int disk_to_fd(disk_t *disk, uint64_t offset);
+int disk_export(disk_t *disk, char *file_name, int text);
+int disk_to_fd(disk_t *disk);
 void disk_add_to_list(disk_t *disk);
+void disk_json_new(disk_t *disk);
+int disk_open(disk_t *disk, char *file_name);
+void disk_free(disk_t *disk);
+void disk_dump_stats(disk_t *disk);
 void disk_init(char *file_name);
 void disk_import(char *file_name);
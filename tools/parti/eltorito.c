@@ -8,6 +8,7 @@
 #include "filesystem.h"
 #include "util.h"
 #include "json.h"
+#include "region.h"
 
 #include "eltorito.h"
 
@@ -18,13 +19,20 @@
 // set to 0 or 2
 #define BLK_FIX		2
 
-static void dump_bootinfo(disk_t *disk, uint64_t sector);
-static char *s390x_parmfile(disk_t *disk, uint64_t start_block);
+// boot info table checksum: read boot file in pieces of this size
+#define BOOTINFO_READ_SIZE	(256 * 1024)
 
-void dump_eltorito(disk_t *disk)
+static void dump_bootinfo(disk_view_t *view, uint64_t sector);
+static uint32_t sum_dwords(uint8_t *buf, size_t len);
+static unsigned bootinfo_sum(disk_view_t *view, uint64_t sector, unsigned file_size);
+static char *s390x_parmfile(disk_view_t *view, uint64_t start_block);
+
+void dump_eltorito(disk_view_t *disk_view)
 {
+  disk_view_t iso_view = disk_view_sub(disk_view, 0, 0x800);
+  disk_view_t *view = &iso_view;
   int i, j;
-  unsigned char buf[disk->block_size = 0x800];
+  unsigned char buf[view->block_size];
   unsigned char zero[32];
   unsigned catalog;
   eltorito_t *el;
@@ -35,25 +43,27 @@ void dump_eltorito(disk_t *disk)
 
   memset(zero, 0, sizeof zero);
 
-  i = disk_read(disk, buf, 0x10, 1);
+  i = disk_view_read(view, buf, 0x10, 1);
 
   if(i || memcmp(buf, ISO_MAGIC, sizeof ISO_MAGIC - 1)) return;
 
-  i = disk_read(disk, buf, 0x11, 1);
+  i = disk_view_read(view, buf, 0x11, 1);
 
   if(i || memcmp(buf, ELTORITO_MAGIC, sizeof ELTORITO_MAGIC - 1)) {
     return;
   }
 
   json_object *json_eltorito = json_object_new_object();
-  json_object_object_add(disk->json_disk, "eltorito", json_eltorito);
+  json_object_object_add(view->json, "eltorito", json_eltorito);
+
+  region_add(view, 0x11, 1, "el torito boot record");
 
   catalog = le32toh(* (uint32_t *) (buf + 0x47));
 
   log_info(SEP "\nel torito:\n");
 
-  json_object_object_add(json_eltorito, "block_size", json_object_new_int(disk->block_size >> BLK_FIX));
-  log_info("  sector size: %d\n", disk->block_size >> BLK_FIX);
+  json_object_object_add(json_eltorito, "block_size", json_object_new_int(view->block_size >> BLK_FIX));
+  log_info("  sector size: %d\n", view->block_size >> BLK_FIX);
 
   json_object_object_add(json_eltorito, "catalog_lba", json_object_new_int(catalog << BLK_FIX));
   log_info("  boot catalog: %u\n", catalog << BLK_FIX);
@@ -61,11 +71,13 @@ void dump_eltorito(disk_t *disk)
   json_object *json_table = json_object_new_array();
   json_object_object_add(json_eltorito, "catalog", json_table);
 
-  i = disk_read(disk, buf, catalog, 1);
+  i = disk_view_read(view, buf, catalog, 1);
 
   if(i) return;
 
-  for(i = 0; i < disk->block_size/32; i++) {
+  region_add(view, catalog, 1, "el torito boot catalog");
+
+  for(i = 0; i < view->block_size/32; i++) {
     el = (eltorito_t *) (buf + 32 * i);
     if(!memcmp(buf + 32 * i, zero, 32)) continue;
 
@@ -135,11 +147,11 @@ void dump_eltorito(disk_t *disk)
           le16toh(el->entry.size),
           BLK_FIX ? "" : "/4"
         );
-        if((s = iso_block_to_name(disk, le32toh(el->entry.start) << 2, NULL))) {
+        if((s = iso_block_to_name(view->disk, le32toh(el->entry.start) << 2, NULL))) {
           json_object_object_add(json_entry, "file_name", json_object_new_string(s));
           log_info(", \"%s\"", s);
           char *parmfile;
-          if((parmfile = s390x_parmfile(disk, le32toh(el->entry.start)))) {
+          if((parmfile = s390x_parmfile(view, le32toh(el->entry.start)))) {
             log_info("\n       s390x_parm = \"%s\"", parmfile);
             json_object_object_add(json_entry, "s390x_parm", json_object_new_string(parmfile));
           }
@@ -148,13 +160,18 @@ void dump_eltorito(disk_t *disk)
         s = cname(el->entry.name, sizeof el->entry.name);
         if(*s) json_object_object_add(json_entry, "criteria_string", json_object_new_string(s));
         log_info("\n       selection criteria 0x%02x \"%s\"\n", el->entry.criteria, s);
-        disk->json_current = json_entry;
-        unsigned old_block_size = disk->block_size;
-        disk->block_size = 512;
-        dump_bootinfo(disk, le32toh(el->entry.start) << BLK_FIX);
-        dump_fs(disk, 7, le32toh(el->entry.start) << BLK_FIX);
-        disk->block_size = old_block_size;
-        disk->json_current = disk->json_disk;
+        disk_view_t view_512 = disk_view_sub(view, 0, 512);
+        view_512.json = json_entry;
+        // floppy emulation: image size follows from the media type
+        static unsigned floppy_blocks[] = { 0, 2400, 2880, 5760 };
+        region_add(
+          &view_512, le32toh(el->entry.start) << BLK_FIX,
+          el->entry.media >= 1 && el->entry.media <= 3 ? floppy_blocks[el->entry.media] : le16toh(el->entry.size),
+          "el torito image %d", i
+        );
+        dump_bootinfo(&view_512, le32toh(el->entry.start) << BLK_FIX);
+        disk_view_t fs_view = disk_view_sub(&view_512, le32toh(el->entry.start) << BLK_FIX, 512);
+        dump_fs(&fs_view, 7);
         break;
 
       case 0x90:
@@ -185,42 +202,39 @@ void dump_eltorito(disk_t *disk)
 }
 
 
-static void dump_bootinfo(disk_t *disk, uint64_t sector)
+/*
+ * Print boot info table of boot file starting at sector of view.
+ */
+static void dump_bootinfo(disk_view_t *view, uint64_t sector)
 {
-  unsigned char buf[disk->block_size];
-  unsigned char pvd[disk->block_size];
-  unsigned char grub_info[disk->block_size];
+  disk_t *disk = view->disk;
+  unsigned char buf[view->block_size];
+  unsigned char pvd[view->block_size];
+  unsigned char grub_info[view->block_size];
 
-  if(disk->block_size < 0x200) return;
+  if(view->block_size < 0x200) return;
 
-  if(disk_read(disk, buf, sector, 1)) return;
+  if(disk_view_read(view, buf, sector, 1)) return;
 
   unsigned bi_pvd = read_dword_le(buf + 8) << BLK_FIX;
   unsigned bi_start = read_dword_le(buf + 12) << BLK_FIX;
   unsigned bi_size = read_dword_le(buf + 16);
   unsigned bi_crc = read_dword_le(buf + 20);
 
-  if((uint64_t) bi_pvd * disk->block_size > disk->size_in_bytes + disk->block_size) return;
-  if(disk_read(disk, pvd, bi_pvd, 1)) return;
+  if((uint64_t) bi_pvd * view->block_size > view->size + view->block_size) return;
+  if(disk_view_read(view, pvd, bi_pvd, 1)) return;
   if(memcmp(pvd, ISO_MAGIC, sizeof ISO_MAGIC - 1)) return;
 
-  unsigned file_size = -1u;
-  iso_block_to_name(disk, sector, &file_size);
+  iso_file_t *file = iso_block_to_file(disk, sector);
+  unsigned file_size = file ? file->len : -1u;
 
   unsigned crc = 0;
 
-  if(file_size == bi_size) {
-    for(unsigned u = 64, block_nr = sector; u < file_size; u += 4) {
-      if(u && !(u % disk->block_size)) {
-        if(disk_read(disk, buf, ++block_nr, 1)) break;
-      }
-      crc += read_dword_le(buf + u % disk->block_size);
-    }
-  }
+  if(file_size == bi_size) crc = bootinfo_sum(view, sector, file_size);
 
   uint64_t grub_lba = 0; 
 
-  if(disk->grub_used && !disk_read(disk, grub_info, sector + 4, 1)) {
+  if(disk->grub_used && !disk_view_read(view, grub_info, sector + 4, 1)) {
     grub_lba = read_qword_le(grub_info + 0x1f4);
   }
 
@@ -234,7 +248,7 @@ static void dump_bootinfo(disk_t *disk, uint64_t sector)
   }
 
   json_object *json_fs = json_object_new_object();
-  json_object_object_add(disk->json_current, "boot_info_table", json_fs);
+  json_object_object_add(view->json, "boot_info_table", json_fs);
 
   json_object_object_add(json_fs, "volume_descriptor_lba", json_object_new_int64(bi_pvd));
   json_object_object_add(json_fs, "file_lba", json_object_new_int64(bi_start));
@@ -254,24 +268,95 @@ static void dump_bootinfo(disk_t *disk, uint64_t sector)
 }
 
 
-static char *s390x_parmfile(disk_t *disk, uint64_t start_block)
+/*
+ * Sum of all little-endian 32 bit words in buf (len bytes, a multiple of 4).
+ *
+ * Eight independent sums so the compiler can vectorize the main loop.
+ */
+static uint32_t sum_dwords(uint8_t *buf, size_t len)
+{
+  uint32_t sum[8] = { }, val;
+  size_t u;
+
+  for(u = 0; u + 32 <= len; u += 32) {
+    for(unsigned i = 0; i < 8; i++) {
+      memcpy(&val, buf + u + 4 * i, 4);
+      sum[i] += le32toh(val);
+    }
+  }
+
+  for(; u + 4 <= len; u += 4) {
+    memcpy(&val, buf + u, 4);
+    sum[0] += le32toh(val);
+  }
+
+  return sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
+}
+
+
+/*
+ * Calculate boot info table checksum of boot file starting at sector.
+ *
+ * That's the sum of all 32 bit words from offset 64 to the end of the file.
+ * If the file size is not a multiple of 4, the last word extends past the
+ * file end.
+ *
+ * The file is read in large pieces, bypassing the cache if possible. If
+ * there's a read error, the checksum covers only the blocks before it.
+ */
+static unsigned bootinfo_sum(disk_view_t *view, uint64_t sector, unsigned file_size)
+{
+  unsigned block_size = view->block_size;
+  uint64_t len = ((uint64_t) file_size + 3) & ~3ull;
+  uint64_t blocks = (len + block_size - 1) / block_size;
+  unsigned run_max = BOOTINFO_READ_SIZE / block_size ?: 1;
+  uint8_t *buf = malloc((size_t) run_max * block_size);
+  uint32_t sum = 0;
+  uint64_t pos = 0;
+  int err = 0;
+
+  for(uint64_t block = 0; block < blocks && !err; block += run_max, pos += (uint64_t) run_max * block_size) {
+    unsigned run = blocks - block < run_max ? blocks - block : run_max;
+
+    if(disk_view_read_nocache(view, buf, sector + block, run)) {
+      // see how far we get
+      unsigned ok;
+      for(ok = 0; ok < run && !disk_view_read_nocache(view, buf + (size_t) ok * block_size, sector + block + ok, 1); ok++);
+      run = ok;
+      err = 1;
+    }
+
+    uint64_t end = pos + (uint64_t) run * block_size;
+    if(end > len) end = len;
+    uint64_t start = pos < 64 ? 64 : pos;
+
+    if(end > start) sum += sum_dwords(buf + (start - pos), end - start);
+  }
+
+  free(buf);
+
+  return sum;
+}
+
+
+static char *s390x_parmfile(disk_view_t *view, uint64_t start_block)
 {
-  static char buffer[2*4096 + 1];
+  static __thread char buffer[2*4096 + 1];
 
-  if(disk->block_size > 4096) return 0;
+  if(view->block_size > 4096) return 0;
 
-  if(disk_read(disk, buffer, start_block, 1)) return 0;
+  if(disk_view_read(view, buffer, start_block, 1)) return 0;
 
   // s390 kernel magic
   if(memcmp(buffer + 8, "\x02\x00\x00\x18\x60\x00\x00\x50\x02\x00\x00\x68\x60\x00\x00\x50\x40\x40\x40\x40\x40\x40\x40\x40", 24)) return 0;
 
   // parmfile: 4 kiB at offset 0x10480
   unsigned parmfile_ofs = 0x10480;
-  unsigned parmfile_blocks = 4096 / disk->block_size;
+  unsigned parmfile_blocks = 4096 / view->block_size;
 
-  if(disk_read(disk, buffer, start_block + parmfile_ofs / disk->block_size, parmfile_blocks + 1)) return 0;
+  if(disk_view_read(view, buffer, start_block + parmfile_ofs / view->block_size, parmfile_blocks + 1)) return 0;
 
-  parmfile_ofs %= disk->block_size;
+  parmfile_ofs %= view->block_size;
 
   buffer[parmfile_ofs + 4096] = 0;
 
@@ -40,4 +40,4 @@ typedef union {
 } eltorito_t;
 
 
-void dump_eltorito(disk_t *disk);
+void dump_eltorito(disk_view_t *view);
@@ -8,6 +8,7 @@
 #include <iconv.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -22,47 +23,87 @@
 #include "disk.h"
 #include "filesystem.h"
 #include "util.h"
+#include "region.h"
 
 typedef struct {
-  char *type;
-  char *label;
-  char *uuid;
-} fs_detail_t;
-
-typedef struct file_start_s {
-  struct file_start_s *next;
-  unsigned block;
-  unsigned len;
-  char *name;
-} file_start_t;
-
-int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset);
-int fs_detail_fat(disk_t *disk, int indent, uint64_t sector);
-int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t sector);
-void read_isoinfo(disk_t *disk);
-
-file_start_t *iso_offsets = NULL;
-int iso_read = 0;
-
-int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset)
+  char *name;			// name (NM)
+  unsigned mode;		// file mode (PX), 0 = unknown
+  unsigned child;		// child link (CL): relocated directory extent
+  unsigned relocated:1;		// relocated directory (RE)
+} iso_rr_t;
+
+typedef struct {
+  unsigned root_extent;
+  unsigned root_size;
+  unsigned rr_skip;		// bytes to skip in system use areas (SP)
+  unsigned rr:1;		// has Rock Ridge extensions
+} iso_info_t;
+
+// max directory nesting
+#define ISO_MAX_DEPTH	64
+
+int fs_probe(fs_detail_t *fs, disk_view_t *view);
+int fs_detail_fat(disk_view_t *view, int indent);
+int fs_detail_iso9660(json_object *json_fs, disk_view_t *view, int indent);
+
+/*
+ * Look for a file system at the start of view.
+ *
+ * Results are cached per disk and offset; the strings in fs belong to the
+ * cache and stay valid until fs_probe_free().
+ */
+int fs_probe(fs_detail_t *fs, disk_view_t *view)
 {
+  disk_t *disk = view->disk;
+  uint64_t offset = view->offset;
   const char *data;
 
+  for(unsigned u = 0; u < disk->probe.size; u++) {
+    if(disk->probe.list[u].offset == offset) {
+      disk->stats.probes_cached++;
+      *fs = disk->probe.list[u].detail;
+
+      return fs->type ? 1 : 0;
+    }
+  }
+
   *fs = (fs_detail_t) {};
 
-  uint8_t buf[disk->block_size];
+  // blkid gets to see only the first 68 kiB of the fs; read them in
+  // advance so they end up in the cache (for disk_export())
+  uint64_t window = 68 * 1024;
 
-  for(uint64_t u = 0; u < 68 * 1024; u += disk->block_size) {
-    disk_read(disk, buf, (offset + u) / disk->block_size, 1);
+  if(disk->size_in_bytes) {
+    if(offset >= disk->size_in_bytes) return 0;
+    if(window > disk->size_in_bytes - offset) window = disk->size_in_bytes - offset;
   }
 
-  int disk_fd = disk_to_fd(disk, offset);
+  unsigned blocks = window / view->block_size;
+  uint8_t *buf = malloc((size_t) blocks * view->block_size);
+
+  disk_view_read(view, buf, 0, blocks);
+
+  free(buf);
+
+  // probe the device directly; imported disks have only the cache,
+  // blkid can't cope with O_DIRECT alignment rules, and compressed images
+  // are only readable through the cache
+  int disk_fd = disk->fd;
+
+  if(disk_fd == -1 || disk->direct || disk->compressed) disk_fd = disk_to_fd(disk);
 
   if(disk_fd == -1) return 0;
 
   blkid_probe pr = blkid_new_probe();
 
-  blkid_probe_set_device(pr, disk_fd, 0, 0);
+  disk->stats.probes++;
+
+  blkid_probe_set_device(pr, disk_fd, offset, window);
+
+  // we need nothing else
+  blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE | BLKID_SUBLKS_LABEL | BLKID_SUBLKS_UUID);
+
+  if(opt.fs_types) blkid_probe_filter_superblocks_type(pr, BLKID_FLTR_ONLYIN, opt.fs_types);
 
   // blkid_probe_get_value(pr, n, &name, &data, &size)
 
@@ -82,7 +123,12 @@ int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset)
 
   blkid_free_probe(pr);
 
-  close(disk_fd);
+  if(disk->probe.size == disk->probe.max) {
+    disk->probe.max = disk->probe.max ? 2 * disk->probe.max : 16;
+    disk->probe.list = reallocarray(disk->probe.list, disk->probe.max, sizeof *disk->probe.list);
+  }
+
+  disk->probe.list[disk->probe.size++] = (fs_probe_t) { .offset = offset, .detail = *fs };
 
   // if(fs->type) printf("ofs = %llu, type = '%s', label = '%s', uuid = '%s'\n", (unsigned long long) offset, fs->type, fs->label ?: "", fs->uuid ?: "");
 
@@ -93,22 +139,22 @@ int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset)
 /*
  * Print fat file system details.
  *
- * The fs starts at sector (sector size is disk->block_size).
+ * The fs starts at the beginning of view (sector size is view->block_size).
  * The output is indented by 'indent' spaces.
  * If indent is 0, prints also a separator line.
  */
-int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
+int fs_detail_fat(disk_view_t *view, int indent)
 {
-  unsigned char buf[disk->block_size];
+  unsigned char buf[view->block_size];
   int i;
   unsigned bpb_len, fat_bits, bpb32;
   unsigned bytes_p_sec, sec_p_cluster, resvd_sec, fats, root_ents, sectors;
   unsigned hidden, fat_secs, data_start, clusters, root_secs;
   unsigned drv_num;
 
-  if(disk->block_size < 0x200) return 0;
+  if(view->block_size < 0x200) return 0;
 
-  i = disk_read(disk, buf, sector, 1);
+  i = disk_view_read(view, buf, 0, 1);
 
   if(i || read_word_le(buf + 0x1fe) != 0xaa55) return 0;
 
@@ -157,6 +203,8 @@ int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
 
   drv_num = read_byte(buf + (bpb32 ? 64 : 36));
 
+  region_add(view, 0, ((uint64_t) sectors * bytes_p_sec + view->block_size - 1) / view->block_size, "fat%u fs", fat_bits);
+
   if(indent == 0) log_info(SEP "\n");
 
   log_info("%*sfat%u:\n", indent, "", fat_bits);
@@ -229,22 +277,22 @@ int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
 /*
  * Print iso9669 file system details.
  *
- * The fs starts at sector (sector size is disk->block_size).
+ * The fs starts at the beginning of view (sector size is view->block_size).
  * The output is indented by 'indent' spaces.
  * If indent is 0, prints also a separator line.
  */
-int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t sector)
+int fs_detail_iso9660(json_object *json_fs, disk_view_t *view, int indent)
 {
-  if(sector || disk->block_size < 0x200) return 0;
+  if(view->offset || view->block_size < 0x200) return 0;
 
 #ifdef __WITH_MEDIA_CHECK__
-  mediacheck_t *media = mediacheck_init(disk->name, 0);
+  mediacheck_t *media = mediacheck_init(view->disk->name, 0);
   if(!media->err && media->signature.start) {
     uint64_t sig_block = media->signature.start;
     int sig_state = media->signature.state.id == sig_not_checked ? 1 : 0;
 
     unsigned sig_size = -1u;
-    char *sig_file = iso_block_to_name(disk, sig_block, &sig_size);
+    char *sig_file = iso_block_to_name(view->disk, sig_block, &sig_size);
 
     log_info("%*ssignature: %"PRIu64" (%ssigned)", indent, "",
       sig_block,
@@ -274,15 +322,16 @@ int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t s
 /*
  * Print file system details.
  *
- * The fs starts at sector (sector size is disk->block_size).
+ * The fs starts at the beginning of view; results are added to view->json.
  * The output is indented by 'indent' spaces.
  * If indent is 0, prints also a separator line.
  */
-int dump_fs(disk_t *disk, int indent, uint64_t sector)
+int dump_fs(disk_view_t *view, int indent)
 {
   char *s;
   fs_detail_t fs_detail;
-  int fs_ok = fs_probe(&fs_detail, disk, sector * disk->block_size);
+  uint64_t sector = view->offset / view->block_size;
+  int fs_ok = fs_probe(&fs_detail, view);
 
   if(!fs_ok) return fs_ok;
 
@@ -292,9 +341,9 @@ int dump_fs(disk_t *disk, int indent, uint64_t sector)
   }
 
   json_object *json_fs = json_object_new_object();
-  json_object_object_add(disk->json_current, "filesystem", json_fs);
+  json_object_object_add(view->json, "filesystem", json_fs);
 
-  json_object_object_add(json_fs, "block_size", json_object_new_int(disk->block_size));
+  json_object_object_add(json_fs, "block_size", json_object_new_int(view->block_size));
   json_object_object_add(json_fs, "first_lba", json_object_new_int64(sector));
 
   json_object_object_add(json_fs, "type", json_object_new_string(fs_detail.type));
@@ -310,128 +359,395 @@ int dump_fs(disk_t *disk, int indent, uint64_t sector)
     log_info(", uuid \"%s\"", fs_detail.uuid);
   }
 
-  if((s = iso_block_to_name(disk, (sector * disk->block_size) >> 9, NULL))) {
+  if((s = iso_block_to_name(view->disk, view->offset >> 9, NULL))) {
     json_object_object_add(json_fs, "file_name", json_object_new_string(s));
     log_info(", \"%s\"", s);
   }
   log_info("\n");
 
-  fs_detail_fat(disk, indent, sector);
-  if(!strcmp(fs_detail.type, "iso9660")) fs_detail_iso9660(json_fs, disk, indent, sector);
+  fs_detail_fat(view, indent);
+  if(!strcmp(fs_detail.type, "iso9660")) fs_detail_iso9660(json_fs, view, indent);
 
   return fs_ok;
 }
 
 
 /*
- * block is in 512 byte units
+ * Free cached fs_probe() results.
  */
-char *iso_block_to_name(disk_t *disk, unsigned block, unsigned *len)
+void fs_probe_free(disk_t *disk)
 {
-  static char *buf = NULL;
-  file_start_t *fs;
-  char *name = NULL;
+  for(unsigned u = 0; u < disk->probe.size; u++) {
+    free(disk->probe.list[u].detail.type);
+    free(disk->probe.list[u].detail.label);
+    free(disk->probe.list[u].detail.uuid);
+  }
+
+  free(disk->probe.list);
+  disk->probe.list = NULL;
+  disk->probe.size = disk->probe.max = 0;
+}
 
-  if(!iso_read) read_isoinfo(disk);
 
-  for(fs = iso_offsets; fs; fs = fs->next) {
-    if(block >= fs->block && block < fs->block + (((fs->len + 2047) >> 11) << 2)) break;
+static int iso_file_cmp(const void *a, const void *b)
+{
+  const iso_file_t *f1 = a, *f2 = b;
+
+  if(f1->start != f2->start) return f1->start < f2->start ? -1 : 1;
+  if(f1->end != f2->end) return f1->end > f2->end ? -1 : 1;
+
+  return strcmp(f1->name, f2->name);
+}
+
+
+/*
+ * Sort file extents and prepare them for lookup.
+ *
+ * Empty files are dropped, they can't be found anyway.
+ */
+static void iso_index_build(disk_t *disk)
+{
+  iso_file_t *files = disk->iso.files;
+  unsigned u, n;
+
+  for(u = n = 0; u < disk->iso.size; u++) {
+    if(files[u].end > files[u].start) {
+      files[n++] = files[u];
+    }
+    else {
+      free(files[u].name);
+    }
+  }
+
+  disk->iso.size = n;
+
+  qsort(files, n, sizeof *files, iso_file_cmp);
+
+  unsigned *max_end = disk->iso.max_end = reallocarray(disk->iso.max_end, n, sizeof *max_end);
+
+  for(u = 0; u < n; u++) {
+    max_end[u] = files[u].end;
+    if(u && max_end[u - 1] > max_end[u]) max_end[u] = max_end[u - 1];
   }
+}
+
+
+/*
+ * Find file containing block, starting at index idx.
+ *
+ * idx must be the last file with start <= block. Extents may overlap, so
+ * look back as long as some earlier extent might still reach block.
+ */
+static iso_file_t *iso_file_at(disk_t *disk, unsigned block, int idx)
+{
+  for(; idx >= 0 && disk->iso.max_end[idx] > block; idx--) {
+    if(disk->iso.files[idx].end > block) return disk->iso.files + idx;
+  }
+
+  return NULL;
+}
+
 
-  if(fs) {
-    if(len) *len = fs->len;
-    if(block == fs->block) {
-      name = fs->name;
+/*
+ * Find file containing block (in 512 byte units).
+ *
+ * If extents overlap, the one starting closest to block wins.
+ */
+iso_file_t *iso_block_to_file(disk_t *disk, unsigned block)
+{
+  if(!disk->iso.read) read_isoinfo(disk);
+
+  // last file with start <= block
+  unsigned lo = 0, hi = disk->iso.size;
+
+  while(lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if(disk->iso.files[mid].start <= block) {
+      lo = mid + 1;
     }
     else {
-      free(buf);
-      asprintf(&buf, "%s<+%u>", fs->name, block - fs->block);
-      name = buf;
+      hi = mid;
     }
   }
 
-  return name;
+  return iso_file_at(disk, block, (int) lo - 1);
 }
 
 
-void read_isoinfo(disk_t *disk)
+static int iso_block_cmp(const void *a, const void *b, void *blocks)
 {
-  FILE *p;
-  char *cmd, *s, *t, *line = NULL, *dir = NULL;
-  size_t line_len = 0;
-  unsigned u1, u2;
-  file_start_t *fs;
-  fs_detail_t fs_detail;
+  unsigned b1 = ((const unsigned *) blocks)[*(const unsigned *) a];
+  unsigned b2 = ((const unsigned *) blocks)[*(const unsigned *) b];
+
+  return b1 < b2 ? -1 : b1 > b2;
+}
 
-  iso_read = 1;
 
-  if(!fs_probe(&fs_detail, disk, 0)) return;
+/*
+ * Look up many blocks (in 512 byte units) at once.
+ *
+ * files[i] is set to the file containing blocks[i] (or NULL). The blocks
+ * are sorted and resolved in a single sweep over the file list.
+ */
+void iso_blocks_to_files(disk_t *disk, unsigned count, unsigned *blocks, iso_file_t **files)
+{
+  unsigned order[count];
+  int idx = -1;
 
-  int tmp_fd = open("/tmp", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+  if(!disk->iso.read) read_isoinfo(disk);
 
-  if(tmp_fd == -1) return;
+  for(unsigned u = 0; u < count; u++) order[u] = u;
 
-  int disk_fd = disk->fd;
+  qsort_r(order, count, sizeof *order, iso_block_cmp, blocks);
+
+  for(unsigned u = 0; u < count; u++) {
+    unsigned block = blocks[order[u]];
+    while(idx + 1 < (int) disk->iso.size && disk->iso.files[idx + 1].start <= block) idx++;
+    files[order[u]] = iso_file_at(disk, block, idx);
+  }
+}
 
-  if(disk_fd == -1) disk_fd = disk_to_fd(disk, 0);
 
-  if(disk_fd == -1) return;
+/*
+ * Get name of file containing block (in 512 byte units).
+ *
+ * If block is not the first file block, the block offset is appended as
+ * '<+offset>'. If len is not NULL, it is set to the file size.
+ *
+ * The returned string is valid until the next call for this disk.
+ */
+char *iso_block_to_name(disk_t *disk, unsigned block, unsigned *len)
+{
+  iso_file_t *file = iso_block_to_file(disk, block);
+
+  if(!file) return NULL;
+
+  if(len) *len = file->len;
+
+  if(block == file->start) return file->name;
+
+  size_t name_len = strlen(file->name) + sizeof "<+4294967295>";
+
+  if(name_len > disk->iso.name_buf_size) {
+    disk->iso.name_buf = realloc(disk->iso.name_buf, disk->iso.name_buf_size = name_len);
+  }
+
+  sprintf(disk->iso.name_buf, "%s<+%u>", file->name, block - file->start);
+
+  return disk->iso.name_buf;
+}
+
+
+/*
+ * Parse Rock Ridge entries in system use area su (len bytes).
+ *
+ * Follows continuation areas (CE). Fills in rr; rr->name must be freed.
+ */
+static void iso_parse_rr(disk_view_t *view, iso_rr_t *rr, uint8_t *su, unsigned len)
+{
+  uint8_t *ce_buf = NULL;
+  unsigned ce_count = 0;
+
+  while(su) {
+    uint64_t ce_block = 0;
+    unsigned ce_ofs = 0, ce_len = 0;
 
-  asprintf(&cmd, "/usr/bin/strace -e lseek -o /proc/self/fd/%d /usr/bin/isoinfo -R -l -i /proc/self/fd/%d 2>/dev/null", tmp_fd, disk_fd);
+    for(unsigned pos = 0, entry_len; pos + 4 <= len; pos += entry_len) {
+      uint8_t *entry = su + pos;
+      entry_len = entry[2];
 
-  if((p = popen(cmd, "r"))) {
-    while(getline(&line, &line_len, p) != -1) {
-      char *line_start = line;
+      if(entry_len < 4 || pos + entry_len > len) break;
 
-      // isoinfo from mkisofs produces different output than the one from genisoimage
-      // remove the optional 1st column (bsc#1097814)
-      while(isspace(*line_start) || isdigit(*line_start)) line_start++;
+      if(!memcmp(entry, "ST", 2)) break;
 
-      if(sscanf(line_start, "Directory listing of %m[^\n]", &s) == 1) {
-        free(dir);
-        dir = s;
+      if(!memcmp(entry, "NM", 2) && entry_len >= 5) {
+        // skip '.' and '..'
+        if(entry[4] & 6) continue;
+        unsigned name_len = rr->name ? strlen(rr->name) : 0;
+        rr->name = realloc(rr->name, name_len + entry_len - 5 + 1);
+        memcpy(rr->name + name_len, entry + 5, entry_len - 5);
+        rr->name[name_len + entry_len - 5] = 0;
+      }
+      else if(!memcmp(entry, "PX", 2) && entry_len >= 12) {
+        rr->mode = read_dword_le(entry + 4);
+      }
+      else if(!memcmp(entry, "CL", 2) && entry_len >= 12) {
+        rr->child = read_dword_le(entry + 4);
       }
-      else if(sscanf(line_start, "%*s %*s %*s %*s %u %*[^[][ %u %*u ] %m[^\n]", &u2, &u1, &s) == 3) {
-        if(*s) {
-          t = s + strlen(s) - 1;
-          while(t >= s && isspace(*t)) *t-- = 0;
-
-          if(strcmp(s, ".") && strcmp(s, "..")) {
-            fs = calloc(1, sizeof *fs);
-            fs->next = iso_offsets;
-            iso_offsets = fs;
-            fs->block = u1 << 2;
-            fs->len = u2;
-            asprintf(&fs->name, "%s%s", dir, s);
-            free(s);
-          }
-        }
+      else if(!memcmp(entry, "RE", 2)) {
+        rr->relocated = 1;
+      }
+      else if(!memcmp(entry, "CE", 2) && entry_len >= 28) {
+        ce_block = read_dword_le(entry + 4);
+        ce_ofs = read_dword_le(entry + 12);
+        ce_len = read_dword_le(entry + 20);
       }
     }
 
-    pclose(p);
+    su = NULL;
+
+    // continuation area; limit the chain length to avoid loops
+    if(ce_block && ce_len && ce_count++ < 16) {
+      // ce_ofs and ce_len are raw 32 bit values - don't let them wrap
+      uint64_t blocks = ((uint64_t) ce_ofs + ce_len + 2047) >> 11;
+      if(ce_ofs >= 2048 || !blocks || blocks > 16 || (uint64_t) ce_ofs + ce_len > blocks << 11) break;
+      ce_buf = realloc(ce_buf, blocks << 11);
+      if(disk_view_read(view, ce_buf, ce_block, blocks)) break;
+      su = ce_buf + ce_ofs;
+      len = ce_len;
+    }
   }
 
-  free(cmd);
-  free(dir);
+  free(ce_buf);
+}
 
-  if(disk->fd == -1) close(disk_fd);
 
-  FILE *f = fdopen(tmp_fd, "r+");
+/*
+ * Read iso9660 directory at block extent (size bytes) and add all entries
+ * to disk->iso.files. Recurses into subdirectories.
+ *
+ * dir is the directory path, including the trailing '/'.
+ * parents holds the extents of the depth parent directories.
+ *
+ * Expects view->block_size to be 2048.
+ */
+static void iso_read_dir(disk_view_t *view, iso_info_t *info, char *dir, unsigned extent, unsigned size, unsigned depth, unsigned *parents)
+{
+  disk_t *disk = view->disk;
+  unsigned blocks = (size + 2047) >> 11;
 
-  unsigned current_block_size = disk->block_size;
-  disk->block_size = 2048;
-  unsigned char tmp_buffer[2048];
+  // 16 MiB - surely corrupt
+  if(!blocks || blocks > 8192) return;
 
-  while(getline(&line, &line_len, f) != -1) {
-    char *s;
-    if((s = strchr(line, '='))) {
-      int64_t ofs = strtoll(s + 1, NULL, 10);
-      disk_read(disk, tmp_buffer, ofs / 2048, 1);
+  uint8_t *buf = malloc(blocks << 11);
+
+  if(disk_view_read(view, buf, extent, blocks)) {
+    free(buf);
+    return;
+  }
+
+  parents[depth] = extent;
+
+  for(unsigned pos = 0, rec_len; pos < size; pos += rec_len) {
+    uint8_t *rec = buf + pos;
+
+    // records don't cross block boundaries
+    if(!(rec_len = rec[0])) {
+      rec_len = 2048 - (pos & 2047);
+      continue;
+    }
+
+    if(rec_len < 34 || pos + rec_len > blocks << 11) break;
+
+    unsigned name_len = rec[32];
+
+    if(33 + name_len > rec_len) break;
+
+    // '.' and '..'
+    if(name_len == 1 && rec[33] <= 1) continue;
+
+    unsigned file_extent = read_dword_le(rec + 2);
+    unsigned file_size = read_dword_le(rec + 10);
+    int is_dir = rec[25] & 2;
+
+    iso_rr_t rr = {};
+
+    if(info->rr) {
+      unsigned su_ofs = 33 + name_len + !(name_len & 1) + info->rr_skip;
+      if(su_ofs < rec_len) iso_parse_rr(view, &rr, rec + su_ofs, rec_len - su_ofs);
+    }
+
+    // relocated directory, listed via its child link
+    if(rr.relocated) {
+      free(rr.name);
+      continue;
+    }
+
+    if(rr.child) {
+      uint8_t tmp[2048];
+      is_dir = 1;
+      file_extent = rr.child;
+      file_size = disk_view_read(view, tmp, file_extent, 1) ? 0 : read_dword_le(tmp + 10);
+    }
+
+    if(rr.mode) is_dir = (rr.mode & 0170000) == 0040000;
+
+    if(disk->iso.size == disk->iso.max) {
+      disk->iso.max = disk->iso.max ? 2 * disk->iso.max : 256;
+      disk->iso.files = reallocarray(disk->iso.files, disk->iso.max, sizeof *disk->iso.files);
+    }
+
+    iso_file_t *file = disk->iso.files + disk->iso.size++;
+    file->start = file_extent << 2;
+    uint64_t file_end = file->start + ((((uint64_t) file_size + 2047) >> 11) << 2);
+    file->end = file_end > UINT_MAX ? UINT_MAX : file_end;
+    file->len = file_size;
+    if(rr.name) {
+      asprintf(&file->name, "%s%s", dir, rr.name);
+    }
+    else {
+      asprintf(&file->name, "%s%.*s", dir, name_len, rec + 33);
+    }
+
+    free(rr.name);
+
+    if(is_dir && depth + 1 < ISO_MAX_DEPTH) {
+      unsigned u;
+      for(u = 0; u <= depth && parents[u] != file_extent; u++);
+      if(u > depth) {
+        char *subdir;
+        asprintf(&subdir, "%s/", file->name);
+        iso_read_dir(view, info, subdir, file_extent, file_size, depth + 1, parents);
+        free(subdir);
+      }
+    }
+  }
+
+  free(buf);
+}
+
+
+/*
+ * Read iso9660 directory tree and build index of file extents (disk->iso).
+ *
+ * Rock Ridge names are used if available.
+ */
+void read_isoinfo(disk_t *disk)
+{
+  unsigned char buf[2048];
+  unsigned parents[ISO_MAX_DEPTH];
+  iso_info_t info = {};
+  disk_view_t view = disk_view(disk, 2048);
+
+  disk->iso.read = 1;
+
+  // look for primary volume descriptor
+  for(unsigned u = 16; u < 16 + 32; u++) {
+    if(disk_view_read(&view, buf, u, 1) || memcmp(buf + 1, "CD001", 5) || buf[0] == 0xff) break;
+
+    if(buf[0] == 1) {
+      info.root_extent = read_dword_le(buf + 156 + 2);
+      info.root_size = read_dword_le(buf + 156 + 10);
+      region_add(&view, 0, read_dword_le(buf + 80), "iso9660 fs");
+      region_add(&view, 16, u - 16 + 1, "iso9660 volume descriptors");
+      break;
     }
   }
 
-  free(line);
+  // Rock Ridge is indicated by a SUSP 'SP' entry in the root directory's '.' entry
+  if(info.root_extent && !disk_view_read(&view, buf, info.root_extent, 1)) {
+    unsigned rec_len = buf[0];
+    unsigned su_ofs = 33 + buf[32] + !(buf[32] & 1);
+    uint8_t *sp = buf + su_ofs;
+    if(rec_len <= sizeof buf && su_ofs + 7 <= rec_len && !memcmp(sp, "SP", 2) && sp[4] == 0xbe && sp[5] == 0xef) {
+      info.rr = 1;
+      info.rr_skip = sp[6];
+    }
+  }
+
+  if(info.root_extent) {
+    iso_read_dir(&view, &info, "/", info.root_extent, info.root_size, 0, parents);
+  }
 
-  disk->block_size = current_block_size;
+  iso_index_build(disk);
 }
@@ -1,2 +1,25 @@
-int dump_fs(disk_t *disk, int indent, uint64_t sector);
+typedef struct {
+  char *type;
+  char *label;
+  char *uuid;
+} fs_detail_t;
+
+// cached fs_probe() result; detail.type is NULL if no fs was found
+typedef struct fs_probe_s {
+  uint64_t offset;		// fs start on disk, in bytes
+  fs_detail_t detail;
+} fs_probe_t;
+
+typedef struct iso_file_s {
+  unsigned start;		// first block (in 512 byte units)
+  unsigned end;			// first block after file
+  unsigned len;			// file size in bytes
+  char *name;
+} iso_file_t;
+
+int dump_fs(disk_view_t *view, int indent);
+void fs_probe_free(disk_t *disk);
+void read_isoinfo(disk_t *disk);
 char *iso_block_to_name(disk_t *disk, unsigned block, unsigned *len);
+iso_file_t *iso_block_to_file(disk_t *disk, unsigned block);
+void iso_blocks_to_files(disk_t *disk, unsigned count, unsigned *blocks, iso_file_t **files);
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "util.h"
+#include "json.h"
+#include "disk.h"
+
+#include "eltorito.h"
+#include "filesystem.h"
+#include "ptable_apple.h"
+#include "ptable_gpt.h"
+#include "ptable_mbr.h"
+#include "region.h"
+#include "zipl.h"
+
+#include "libparti.h"
+
+
+static void dump_disk_fs(disk_view_t *view)
+{
+  dump_fs(view, 0);
+}
+
+
+static void stats_timer_add(disk_t *disk, char *name, struct timespec *start);
+
+
+static struct {
+  unsigned id;
+  char *name;
+  void (*dump)(disk_view_t *view);
+} analyzers[] = {
+  { PARTI_FS,       "dump_fs",            dump_disk_fs       },
+  { PARTI_MBR,      "dump_mbr_ptable",    dump_mbr_ptable    },
+  { PARTI_GPT,      "dump_gpt_ptables",   dump_gpt_ptables   },
+  { PARTI_APPLE,    "dump_apple_ptables", dump_apple_ptables },
+  { PARTI_ELTORITO, "dump_eltorito",      dump_eltorito      },
+  { PARTI_ZIPL,     "dump_zipl",          dump_zipl          },
+};
+
+
+/*
+ * Open disk device or image file_name.
+ *
+ * Library users get JSON results only, so this turns off text output for
+ * this disk (the global options are not touched).
+ *
+ * Returns NULL and sets errno on failure.
+ */
+parti_t *parti_open(const char *file_name)
+{
+  disk_t *disk = calloc(1, sizeof *disk);
+
+  if(!disk) return NULL;
+
+  int err = disk_open(disk, (char *) file_name);
+
+  if(err) {
+    free(disk);
+    errno = err;
+
+    return NULL;
+  }
+
+  disk->json_only = 1;
+
+  disk_json_new(disk);
+
+  return disk;
+}
+
+
+/*
+ * Run analyzers (a set of PARTI_* flags) on disk.
+ *
+ * With PARTI_LBA_MAP, the analyzers record which blocks they find in use
+ * and dump_lba_map() reports gaps and overlaps at the end.
+ *
+ * With --stats, also measure their run time and print disk statistics.
+ */
+void parti_analyze(parti_t *disk, unsigned ids)
+{
+  struct timespec start;
+  unsigned old_log_off = log_off;
+
+  log_off = disk->json_only;
+
+  if((ids & PARTI_LBA_MAP)) disk->regions.enabled = 1;
+
+  for(unsigned u = 0; u < sizeof analyzers / sizeof *analyzers; u++) {
+    if(!(ids & analyzers[u].id)) continue;
+
+    if(opt.stats) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // every analyzer gets its own view, starting with the logical block size
+    disk_view_t view = disk_view(disk, disk->sector_size);
+
+    analyzers[u].dump(&view);
+
+    if(opt.stats) stats_timer_add(disk, analyzers[u].name, &start);
+  }
+
+  if((ids & PARTI_LBA_MAP)) {
+    if(opt.stats) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    dump_lba_map(disk);
+
+    if(opt.stats) stats_timer_add(disk, "dump_lba_map", &start);
+  }
+
+  if(opt.stats) disk_dump_stats(disk);
+
+  log_off = old_log_off;
+}
+
+
+/*
+ * Record run time since start as timer name.
+ */
+static void stats_timer_add(disk_t *disk, char *name, struct timespec *start)
+{
+  struct timespec end;
+
+  if(disk->stats.timers >= DISK_STATS_TIMERS) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  disk->stats.timer[disk->stats.timers].name = name;
+  disk->stats.timer[disk->stats.timers++].usec =
+    (end.tv_sec - start->tv_sec) * 1000000ll + (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+/*
+ * Analysis results.
+ *
+ * The object belongs to disk; take a reference if you need it after
+ * parti_close().
+ */
+json_object *parti_json(parti_t *disk)
+{
+  return disk->json_disk;
+}
+
+
+/*
+ * Analysis results as compact JSON string.
+ *
+ * The string is valid until the next parti_analyze() or parti_close().
+ */
+const char *parti_json_string(parti_t *disk)
+{
+  return json_object_to_json_string_ext(disk->json_disk, JSON_C_TO_STRING_PLAIN + JSON_C_TO_STRING_NOSLASHESCAPE);
+}
+
+
+/*
+ * Close disk and free all resources, including the JSON results.
+ */
+void parti_close(parti_t *disk)
+{
+  if(!disk) return;
+
+  json_object_put(disk->json_disk);
+  disk_free(disk);
+  free(disk);
+}
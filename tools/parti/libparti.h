@@ -0,0 +1,43 @@
+/*
+ * libparti - partition table and file system layout of disk images.
+ *
+ * Typical use:
+ *
+ *   parti_t *parti = parti_open("foo.iso");
+ *   parti_analyze(parti, PARTI_ALL);
+ *   ... parti_json(parti) ...
+ *   parti_close(parti);
+ *
+ * The results are the same as 'parti --json' shows. The library does not
+ * produce any text output.
+ */
+
+#ifndef LIBPARTI_H
+#define LIBPARTI_H
+
+struct json_object;
+
+// analyzers, see parti_analyze()
+#define PARTI_FS		(1 << 0)
+#define PARTI_MBR		(1 << 1)
+#define PARTI_GPT		(1 << 2)
+#define PARTI_APPLE		(1 << 3)
+#define PARTI_ELTORITO		(1 << 4)
+#define PARTI_ZIPL		(1 << 5)
+#define PARTI_ALL		((1 << 6) - 1)
+
+// block ownership map (gaps and overlaps) of everything the analyzers found
+#define PARTI_LBA_MAP		(1 << 6)
+
+typedef struct disk_s parti_t;
+
+// the only symbols libparti.so exports (it's built with -fvisibility=hidden)
+#define PARTI_API		__attribute__((visibility("default")))
+
+PARTI_API parti_t *parti_open(const char *file_name);
+PARTI_API void parti_analyze(parti_t *parti, unsigned analyzers);
+PARTI_API struct json_object *parti_json(parti_t *parti);
+PARTI_API const char *parti_json_string(parti_t *parti);
+PARTI_API void parti_close(parti_t *parti);
+
+#endif
@@ -1,5 +1,11 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <inttypes.h>
 #include <getopt.h>
 
@@ -7,18 +13,25 @@
 #include "json.h"
 #include "disk.h"
 
-#include "eltorito.h"
-#include "filesystem.h"
-#include "ptable_apple.h"
-#include "ptable_gpt.h"
-#include "ptable_mbr.h"
-#include "zipl.h"
+#include "libparti.h"
 
 #ifndef VERSION
 #define VERSION "0.0"
 #endif
 
+// upper limit for --jobs
+#define MAX_JOBS	256
+
 void help(void);
+unsigned job_count(void);
+void analyze_disks(void);
+void *analyze_worker(void *arg);
+int batch(char *file_name);
+void *batch_worker(void *arg);
+json_object *batch_analyze(char *file_name);
+
+// analyzers to run, see parti_analyze()
+static unsigned analyzers = PARTI_ALL;
 
 struct option options[] = {
   { "help",        0, NULL, 'h'  },
@@ -28,6 +41,13 @@ struct option options[] = {
   { "export-disk", 1, NULL, 1003 },
   { "import-disk", 1, NULL, 1004 },
   { "json",        0, NULL, 1005 },
+  { "export-format", 1, NULL, 1006 },
+  { "jobs",        1, NULL, 1007 },
+  { "batch",       1, NULL, 1008 },
+  { "stats",       0, NULL, 1009 },
+  { "direct",      0, NULL, 1010 },
+  { "fs-types",    1, NULL, 1011 },
+  { "lba-map",     0, NULL, 1012 },
   { }
 };
 
@@ -35,6 +55,7 @@ struct option options[] = {
 int main(int argc, char **argv)
 {
   int i;
+  char *batch_file = NULL;
   extern int optind;
   extern int opterr;
 
@@ -69,6 +90,57 @@ int main(int argc, char **argv)
         opt.json = 1;
         break;
 
+      case 1006:
+        if(!strcmp(optarg, "text")) {
+          opt.export_text = 1;
+        }
+        else if(!strcmp(optarg, "binary")) {
+          opt.export_text = 0;
+        }
+        else {
+          fprintf(stderr, "%s: unsupported export format\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 1007:
+        {
+          char *err;
+          opt.jobs = strtoul(optarg, &err, 0);
+          if(*err || !opt.jobs) {
+            fprintf(stderr, "%s: invalid number of jobs\n", optarg);
+            return 1;
+          }
+        }
+        break;
+
+      case 1008:
+        batch_file = optarg;
+        break;
+
+      case 1009:
+        opt.stats = 1;
+        break;
+
+      case 1010:
+        opt.direct = 1;
+        break;
+
+      case 1011:
+        {
+          unsigned n = 0;
+          for(char *s = strtok(optarg, ","); s; s = strtok(NULL, ",")) {
+            opt.fs_types = realloc(opt.fs_types, (n + 2) * sizeof *opt.fs_types);
+            opt.fs_types[n++] = s;
+            opt.fs_types[n] = NULL;
+          }
+        }
+        break;
+
+      case 1012:
+        analyzers |= PARTI_LBA_MAP;
+        break;
+
       default:
         help();
         return i == 'h' ? 0 : 1;
@@ -78,6 +150,15 @@ int main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
+  if(batch_file) {
+    if(*argv || disk_list_size || opt.export_file) {
+      fprintf(stderr, "--batch can't be combined with disk devices, --import-disk, or --export-disk\n");
+      return 1;
+    }
+
+    return batch(batch_file);
+  }
+
   while(*argv) disk_init(*argv++);
 
   if(!disk_list_size) {
@@ -86,19 +167,12 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  for(unsigned u = 0; u < disk_list_size; u++) {
-    dump_fs(disk_list + u, 0, 0);
-    dump_mbr_ptable(disk_list + u);
-    dump_gpt_ptables(disk_list + u);
-    dump_apple_ptables(disk_list + u);
-    dump_eltorito(disk_list + u);
-    dump_zipl(disk_list + u);
-  }
+  analyze_disks();
 
   if(opt.export_file) {
     unlink(opt.export_file);
     for(unsigned u = 0; u < disk_list_size; u++) {
-      disk_export(disk_list + u, opt.export_file);
+      disk_export(disk_list + u, opt.export_file, opt.export_text);
     }
   }
 
@@ -110,6 +184,207 @@ int main(int argc, char **argv)
 }
 
 
+/*
+ * Number of parallel jobs: opt.jobs or number of CPUs, at most MAX_JOBS.
+ */
+unsigned job_count()
+{
+  long jobs = opt.jobs ?: sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(jobs < 1) jobs = 1;
+  if(jobs > MAX_JOBS) jobs = MAX_JOBS;
+
+  return jobs;
+}
+
+
+static unsigned next_disk;
+static char **disk_log;
+static size_t *disk_log_size;
+
+/*
+ * Analyze all disks.
+ *
+ * With more than one disk, they are analyzed in parallel (up to opt.jobs
+ * at a time). The text output is collected per disk and printed in disk
+ * order, so it's the same as when run sequentially.
+ */
+void analyze_disks()
+{
+  unsigned jobs = job_count();
+
+  if(jobs > disk_list_size) jobs = disk_list_size;
+
+  if(jobs <= 1) {
+    for(unsigned u = 0; u < disk_list_size; u++) parti_analyze(disk_list + u, analyzers);
+
+    return;
+  }
+
+  pthread_t *threads = calloc(jobs - 1, sizeof *threads);
+  unsigned threads_started;
+
+  disk_log = calloc(disk_list_size, sizeof *disk_log);
+  disk_log_size = calloc(disk_list_size, sizeof *disk_log_size);
+
+  for(threads_started = 0; threads && threads_started < jobs - 1; threads_started++) {
+    if(pthread_create(threads + threads_started, NULL, analyze_worker, NULL)) break;
+  }
+
+  // the main thread helps out
+  analyze_worker(NULL);
+
+  for(unsigned u = 0; u < threads_started; u++) pthread_join(threads[u], NULL);
+
+  free(threads);
+
+  for(unsigned u = 0; u < disk_list_size; u++) {
+    if(disk_log[u]) {
+      fwrite(disk_log[u], disk_log_size[u], 1, stdout);
+      free(disk_log[u]);
+    }
+  }
+
+  free(disk_log);
+  free(disk_log_size);
+}
+
+
+/*
+ * Worker thread: analyze disks until there are none left.
+ */
+void *analyze_worker(void *arg)
+{
+  unsigned u;
+
+  while((u = __atomic_fetch_add(&next_disk, 1, __ATOMIC_RELAXED)) < disk_list_size) {
+    log_file = open_memstream(disk_log + u, disk_log_size + u);
+    parti_analyze(disk_list + u, analyzers);
+    if(log_file) fclose(log_file);
+    log_file = NULL;
+  }
+
+  return NULL;
+}
+
+
+static FILE *batch_in;
+static pthread_mutex_t batch_in_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t batch_out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned batch_errors;
+
+/*
+ * Analyze all disk devices listed in file_name ("-" means stdin), one per line.
+ *
+ * Up to opt.jobs disks are analyzed in parallel. For each disk, a single
+ * line with its JSON object is written as soon as it's done (so the
+ * order is not fixed). If a disk can't be opened, the object has an
+ * "error" entry instead of the usual details.
+ *
+ * Returns 0 if all disks could be opened, else 1.
+ */
+int batch(char *file_name)
+{
+  unsigned jobs = job_count();
+
+  batch_in = strcmp(file_name, "-") ? fopen(file_name, "r") : stdin;
+
+  if(!batch_in) {
+    perror(file_name);
+    return 1;
+  }
+
+  // no text output
+  opt.json = 1;
+
+  pthread_t *threads = calloc(jobs, sizeof *threads);
+  unsigned threads_started;
+
+  for(threads_started = 0; threads && threads_started + 1 < jobs; threads_started++) {
+    if(pthread_create(threads + threads_started, NULL, batch_worker, NULL)) break;
+  }
+
+  batch_worker(NULL);
+
+  for(unsigned u = 0; u < threads_started; u++) pthread_join(threads[u], NULL);
+
+  free(threads);
+
+  if(batch_in != stdin) fclose(batch_in);
+
+  return batch_errors ? 1 : 0;
+}
+
+
+/*
+ * Worker thread: analyze disks from batch_in until there are none left.
+ */
+void *batch_worker(void *arg)
+{
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t len;
+
+  for(;;) {
+    pthread_mutex_lock(&batch_in_mutex);
+    len = getline(&line, &line_len, batch_in);
+    pthread_mutex_unlock(&batch_in_mutex);
+
+    if(len < 0) break;
+
+    if(len && line[len - 1] == '\n') line[--len] = 0;
+    if(!len) continue;
+
+    json_object *json = batch_analyze(line);
+    const char *str = json_object_to_json_string_ext(json, JSON_C_TO_STRING_PLAIN + JSON_C_TO_STRING_NOSLASHESCAPE);
+
+    pthread_mutex_lock(&batch_out_mutex);
+    printf("%s\n", str);
+    fflush(stdout);
+    pthread_mutex_unlock(&batch_out_mutex);
+
+    json_object_put(json);
+  }
+
+  free(line);
+
+  return NULL;
+}
+
+
+/*
+ * Analyze a single disk in batch mode.
+ *
+ * Returns the JSON object with the results.
+ */
+json_object *batch_analyze(char *file_name)
+{
+  parti_t *parti = parti_open(file_name);
+
+  if(!parti) {
+    char buf[256];
+    json_object *json = json_object_new_object();
+    json_object *json_device = json_object_new_object();
+
+    json_object_object_add(json, "device", json_device);
+    json_object_object_add(json_device, "file_name", json_object_new_string(file_name));
+    json_object_object_add(json, "error", json_object_new_string(strerror_r(errno, buf, sizeof buf)));
+
+    __atomic_fetch_add(&batch_errors, 1, __ATOMIC_RELAXED);
+
+    return json;
+  }
+
+  parti_analyze(parti, analyzers);
+
+  json_object *json = json_object_get(parti_json(parti));
+
+  parti_close(parti);
+
+  return json;
+}
+
+
 void help()
 {
   fprintf(stderr,
@@ -118,12 +393,27 @@ void help()
     "\n"
     "Print information about disk devices.\n"
     "\n"
+    "Disk devices can also be image files (optionally xz or zstd compressed) or\n"
+    "http/https URLs (read with range requests).\n"
+    "\n"
     "Options:\n"
     "\n"
     "  --json              Use JSON format for output.\n"
     "  --export-disk FILE  Export all relevant disk data to FILE. FILE can then be used\n"
     "                      with --import-disk to reproduce the results.\n"
-    "  --import-disk FILE  Import relevant disk data from FILE.\n"
+    "  --export-format FORMAT\n"
+    "                      Format for --export-disk: 'binary' (default) or 'text' (hex dump).\n"
+    "  --import-disk FILE  Import relevant disk data from FILE. The format is detected\n"
+    "                      automatically.\n"
+    "  --batch FILE        Read disk devices from FILE ('-' for stdin), one per line, and\n"
+    "                      write one line of JSON per device as soon as it's done.\n"
+    "  --jobs N            Analyze up to N disks in parallel (default: number of CPUs).\n"
+    "  --stats             Show I/O statistics and analyzer run times.\n"
+    "  --direct            Read disk devices with O_DIRECT, bypassing the page cache.\n"
+    "  --fs-types LIST     Look only for these file system types (comma-separated list of\n"
+    "                      libblkid names, e.g. 'iso9660,vfat').\n"
+    "  --lba-map           Show which blocks are used by what, and report unused blocks\n"
+    "                      and partially overlapping areas.\n"
     "  --verbose           Report more details.\n"
     "  --version           Show version.\n"
     "  --help              Print this help text.\n"
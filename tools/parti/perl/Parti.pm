@@ -0,0 +1,31 @@
+package Parti;
+
+# Perl binding for libparti.
+#
+# my $parti = Parti::analyze($file);
+#
+# Returns a hash ref with the same data 'parti --json $file' shows, or
+# undef if $file can't be opened ($! is set then).
+#
+# An optional second argument limits the analyzers run (see PARTI_*
+# constants below; default: all).
+
+use strict;
+
+use constant {
+  PARTI_FS       => 1 << 0,
+  PARTI_MBR      => 1 << 1,
+  PARTI_GPT      => 1 << 2,
+  PARTI_APPLE    => 1 << 3,
+  PARTI_ELTORITO => 1 << 4,
+  PARTI_ZIPL     => 1 << 5,
+  PARTI_ALL      => (1 << 6) - 1,
+  PARTI_LBA_MAP  => 1 << 6,
+};
+
+our $VERSION = '0.0';
+
+require XSLoader;
+XSLoader::load('Parti', $VERSION);
+
+1;
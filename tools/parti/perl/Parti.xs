@@ -0,0 +1,76 @@
+#include "EXTERN.h"
+#include "perl.h"
+#include "XSUB.h"
+
+#include <errno.h>
+#include <json-c/json.h>
+
+#include "../libparti.h"
+
+/*
+ * Convert JSON object to Perl data structure.
+ */
+static SV *json_to_sv(pTHX_ json_object *json)
+{
+  switch(json_object_get_type(json)) {
+    case json_type_boolean:
+      return newSVsv(json_object_get_boolean(json) ? &PL_sv_yes : &PL_sv_no);
+
+    case json_type_double:
+      return newSVnv(json_object_get_double(json));
+
+    case json_type_int:
+      return newSViv(json_object_get_int64(json));
+
+    case json_type_string:
+      {
+        SV *sv = newSVpvn(json_object_get_string(json), json_object_get_string_len(json));
+        SvUTF8_on(sv);
+        return sv;
+      }
+
+    case json_type_array:
+      {
+        AV *av = newAV();
+        size_t len = json_object_array_length(json);
+        av_extend(av, len);
+        for(size_t u = 0; u < len; u++) {
+          av_push(av, json_to_sv(aTHX_ json_object_array_get_idx(json, u)));
+        }
+        return newRV_noinc((SV *) av);
+      }
+
+    case json_type_object:
+      {
+        HV *hv = newHV();
+        json_object_object_foreach(json, key, val) {
+          hv_store(hv, key, strlen(key), json_to_sv(aTHX_ val), 0);
+        }
+        return newRV_noinc((SV *) hv);
+      }
+
+    default:
+      return newSV(0);
+  }
+}
+
+
+MODULE = Parti		PACKAGE = Parti
+
+SV *
+analyze(file_name, analyzers = PARTI_ALL)
+    const char *file_name
+    unsigned analyzers
+  CODE:
+    parti_t *parti = parti_open(file_name);
+    if(parti) {
+      parti_analyze(parti, analyzers);
+      RETVAL = json_to_sv(aTHX_ parti_json(parti));
+      parti_close(parti);
+    }
+    else {
+      SETERRNO(errno, 0);
+      RETVAL = &PL_sv_undef;
+    }
+  OUTPUT:
+    RETVAL
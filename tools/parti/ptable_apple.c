@@ -10,26 +10,28 @@
 #include "filesystem.h"
 #include "util.h"
 #include "json.h"
+#include "region.h"
 
 #include "ptable_apple.h"
 
-void dump_apple_ptables(disk_t *disk)
+void dump_apple_ptables(disk_view_t *view)
 {
-  for(disk->block_size = 0x200; disk->block_size <= 0x1000; disk->block_size <<= 1) {
-    if(dump_apple_ptable(disk)) return;
+  for(unsigned block_size = 0x200; block_size <= 0x1000; block_size <<= 1) {
+    disk_view_t apple_view = disk_view_sub(view, 0, block_size);
+    if(dump_apple_ptable(&apple_view)) return;
   }
 }
 
 
-int dump_apple_ptable(disk_t *disk)
+int dump_apple_ptable(disk_view_t *view)
 {
   int i, parts;
   unsigned u1, u2;
-  unsigned char buf[disk->block_size];
+  unsigned char buf[view->block_size];
   apple_entry_t *apple;
   char *s;
 
-  i = disk_read(disk, buf, 1, 1);
+  i = disk_view_read(view, buf, 1, 1);
 
   apple = (apple_entry_t *) buf;
 
@@ -38,19 +40,21 @@ int dump_apple_ptable(disk_t *disk)
   parts = be32toh(apple->partitions);
 
   json_object *json_apple = json_object_new_object();
-  json_object_object_add(disk->json_disk, "apple", json_apple);
+  json_object_object_add(view->json, "apple", json_apple);
 
-  json_object_object_add(json_apple, "block_size", json_object_new_int(disk->block_size));
+  region_add(view, 1, parts, "apple partition map");
+
+  json_object_object_add(json_apple, "block_size", json_object_new_int(view->block_size));
   json_object_object_add(json_apple, "entries", json_object_new_int(parts));
 
   log_info(SEP "\napple partition table: %d entries\n", parts);
-  log_info("  sector size: %d\n", disk->block_size);
+  log_info("  sector size: %d\n", view->block_size);
 
   json_object *json_table = json_object_new_array();
   json_object_object_add(json_apple, "partitions", json_table);
 
   for(i = 1; i <= parts; i++) {
-    if(disk_read(disk, buf, i, 1)) break;
+    if(disk_view_read(view, buf, i, 1)) break;
     apple = (apple_entry_t *) buf;
 
     json_object *json_entry = json_object_new_object();
@@ -67,6 +71,8 @@ int dump_apple_ptable(disk_t *disk)
     json_object_object_add(json_entry, "last_lba", json_object_new_int64(u1 + u2 - 1));
     json_object_object_add(json_entry, "size", json_object_new_int64(u2));
 
+    region_add(view, u1, u2, "apple partition %d", i);
+
     u1 = be32toh(apple->data_start);
     u2 = be32toh(apple->data_size);
     log_info(", rel. %u - %llu (size %u)\n", u1, (unsigned long long) u1 + u2, u2);
@@ -88,9 +94,9 @@ int dump_apple_ptable(disk_t *disk)
 
     json_object_object_add(json_entry, "name", json_object_new_string(s));
 
-    disk->json_current = json_entry;
-    dump_fs(disk, 5, be32toh(apple->start));
-    disk->json_current = disk->json_disk;
+    disk_view_t fs_view = disk_view_sub(view, be32toh(apple->start), view->block_size);
+    fs_view.json = json_entry;
+    dump_fs(&fs_view, 5);
   }
 
   return 1;
@@ -13,5 +13,5 @@ typedef struct {
   uint32_t status;
 } apple_entry_t;
 
-void dump_apple_ptables(disk_t *disk);
-int dump_apple_ptable(disk_t *disk);
+void dump_apple_ptables(disk_view_t *view);
+int dump_apple_ptable(disk_view_t *view);
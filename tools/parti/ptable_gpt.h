@@ -1 +1 @@
-void dump_gpt_ptables(disk_t *disk);
+void dump_gpt_ptables(disk_view_t *view);
@@ -10,6 +10,7 @@
 #include "filesystem.h"
 #include "util.h"
 #include "json.h"
+#include "region.h"
 
 #include "ptable_mbr.h"
 
@@ -35,7 +36,7 @@ unsigned cs2c(unsigned cs);
 char *mbr_partition_type(unsigned id);
 void parse_ptable(void *buf, unsigned addr, ptable_t *ptable, unsigned base, unsigned ext_base, int entries);
 int guess_geo(ptable_t *ptable, int entries, unsigned *s, unsigned *h);
-void print_ptable_entry(json_object *json_table, disk_t *disk, int nr, ptable_t *ptable, int index);
+void print_ptable_entry(json_object *json_table, disk_view_t *view, int nr, ptable_t *ptable, int index);
 int is_ext_ptable(ptable_t *ptable);
 ptable_t *find_ext_ptable(ptable_t *ptable, int entries);
 
@@ -146,7 +147,7 @@ int guess_geo(ptable_t *ptable, int entries, unsigned *s, unsigned *h)
 }
 
 
-void print_ptable_entry(json_object *json_table, disk_t *disk, int nr, ptable_t *ptable, int index)
+void print_ptable_entry(json_object *json_table, disk_view_t *view, int nr, ptable_t *ptable, int index)
 {
   unsigned u;
 
@@ -163,6 +164,14 @@ void print_ptable_entry(json_object *json_table, disk_t *disk, int nr, ptable_t
     json_object_object_add(json_attributes, "boot", json_object_new_boolean(ptable->boot));
     json_object_object_add(json_attributes, "valid", json_object_new_boolean(1));
 
+    // links to the next extended partition table are no real partitions
+    if(nr <= 4 || !is_ext_ptable(ptable)) {
+      region_add(
+        view, (uint64_t) ptable->start.lin + ptable->base, (uint64_t) ptable->end.lin - ptable->start.lin + 1,
+        "mbr partition %d", nr
+      );
+    }
+
     if(nr > 4 && is_ext_ptable(ptable)) {
       if(!opt.verbose) return;
       log_info("    >");
@@ -219,9 +228,9 @@ void print_ptable_entry(json_object *json_table, disk_t *disk, int nr, ptable_t
     }
     log_info("\n");
 
-    disk->json_current = json_entry;
-    dump_fs(disk, 7, (uint64_t) ptable->start.lin + ptable->base);
-    disk->json_current = disk->json_disk;
+    disk_view_t fs_view = disk_view_sub(view, (uint64_t) ptable->start.lin + ptable->base, view->block_size);
+    fs_view.json = json_entry;
+    dump_fs(&fs_view, 7);
   }
   else if(!ptable->empty) {
     log_info("  %-3d  invalid data\n", nr);
@@ -259,14 +268,15 @@ ptable_t *find_ext_ptable(ptable_t *ptable, int entries)
 }
 
 
-void dump_mbr_ptable(disk_t *disk)
+void dump_mbr_ptable(disk_view_t *view)
 {
+  disk_t *disk = view->disk;
   int i, j, pcnt, link_count;
   ptable_t ptable[4], *ptable_ext;
   unsigned s, h, ext_base, id;
-  unsigned char buf[disk->block_size];
+  unsigned char buf[view->block_size];
 
-  i = disk_read(disk, buf, 0, 1);
+  i = disk_view_read(view, buf, 0, 1);
 
   if(i || read_word_le(buf + 0x1fe) != 0xaa55) {
     return;
@@ -282,7 +292,9 @@ void dump_mbr_ptable(disk_t *disk)
   if(!j && !id) return;
 
   json_object *json_mbr = json_object_new_object();
-  json_object_object_add(disk->json_disk, "mbr", json_mbr);
+  json_object_object_add(view->json, "mbr", json_mbr);
+
+  region_add(view, 0, 1, "mbr");
 
   parse_ptable(buf, 0x1be, ptable, 0, 0, 4);
   i = guess_geo(ptable, 4, &s, &h);
@@ -292,12 +304,12 @@ void dump_mbr_ptable(disk_t *disk)
   }
   disk->sectors = s;
   disk->heads = h;
-  disk->cylinders = disk->size_in_bytes / ((uint64_t) disk->block_size * disk->sectors * disk->heads);
+  disk->cylinders = disk->size_in_bytes / ((uint64_t) view->block_size * disk->sectors * disk->heads);
 
   log_info(SEP "\nmbr id: 0x%08x\n", id);
 
-  json_object_object_add(json_mbr, "block_size", json_object_new_int(disk->block_size));
-  log_info("  sector size: %u\n", disk->block_size);
+  json_object_object_add(json_mbr, "block_size", json_object_new_int(view->block_size));
+  log_info("  sector size: %u\n", view->block_size);
 
   json_object_object_add(json_mbr, "id", json_object_new_format("0x%08x", id));
 
@@ -311,11 +323,11 @@ void dump_mbr_ptable(disk_t *disk)
   if(bi_start) {
     char *s;
     char *bi_type = "bootinfo";
-    if(memmem(buf, disk->block_size, "isolinux.bin", sizeof "isolinux.bin" - 1)) {
+    if(memmem(buf, view->block_size, "isolinux.bin", sizeof "isolinux.bin" - 1)) {
       bi_type = "isolinux";
       disk->isolinux_used = 1;
     }
-    else if(memmem(buf, disk->block_size, "GRUB", sizeof "GRUB" - 1)) {
+    else if(memmem(buf, view->block_size, "GRUB", sizeof "GRUB" - 1)) {
       bi_type = "grub";
       disk->grub_used = 1;
       // grub stores offset to image + 4 blocks
@@ -354,7 +366,7 @@ void dump_mbr_ptable(disk_t *disk)
   json_object_object_add(json_mbr, "partitions", json_table);
 
   for(i = 0; i < 4; i++) {
-    print_ptable_entry(json_table, disk, i + 1, ptable + i, i);
+    print_ptable_entry(json_table, view, i + 1, ptable + i, i);
   }
 
   pcnt = 5;
@@ -371,15 +383,16 @@ void dump_mbr_ptable(disk_t *disk)
       log_info("too many partitions\n");
       break;
     }
-    j = disk_read(disk, buf, ptable_ext->start.lin + ptable_ext->base, 1);
+    j = disk_view_read(view, buf, ptable_ext->start.lin + ptable_ext->base, 1);
     if(j || read_word_le(buf + 0x1fe) != 0xaa55) {
       if(j) log_info("disk read error - ");
       log_info("not a valid extended partition\n");
       break;
     }
+    region_add(view, ptable_ext->start.lin + ptable_ext->base, 1, "mbr extended partition table");
     parse_ptable(buf, 0x1be, ptable, ptable_ext->start.lin + ptable_ext->base, ext_base, 4);
     for(i = 0; i < 4; i++) {
-      print_ptable_entry(json_table, disk, pcnt, ptable + i, i);
+      print_ptable_entry(json_table, view, pcnt, ptable + i, i);
       if(ptable[i].valid && !is_ext_ptable(ptable + i)) pcnt++;
     }
   }
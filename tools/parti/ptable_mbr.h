@@ -1 +1 @@
-void dump_mbr_ptable(disk_t *disk);
+void dump_mbr_ptable(disk_view_t *view);
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "util.h"
+#include "json.h"
+#include "disk.h"
+#include "filesystem.h"
+#include "region.h"
+
+/*
+ * Block ownership map (--lba-map).
+ *
+ * While analyzing, all structures found on the disk register the blocks
+ * they occupy with region_add(). dump_lba_map() then reports blocks nobody
+ * claims (gaps) and regions that partially overlap (one starts inside the
+ * other but extends past its end). Regions that are nested or identical
+ * are fine: a FAT image can be an iso9660 file, an El Torito image, and a
+ * GPT partition at the same time.
+ */
+
+typedef struct {
+  unsigned outer;		// index of region that starts first
+  unsigned inner;		// index of region that starts inside outer and ends after it
+} region_overlap_t;
+
+typedef struct {
+  region_overlap_t *list;
+  unsigned size;
+  unsigned max;
+} region_overlaps_t;
+
+static int region_cmp(const void *a, const void *b);
+static void region_find_overlaps(region_overlaps_t *overlaps, uint64_t *tree, unsigned tree_size, unsigned node, unsigned node_start, unsigned node_end, unsigned start, unsigned end, unsigned outer, uint64_t last);
+static json_object *region_json(region_t *region);
+
+
+/*
+ * Register blocks block ... block + blocks - 1 of view as owned by the
+ * structure name.
+ *
+ * Does nothing unless the disk collects regions (disk->regions.enabled).
+ */
+void region_add(disk_view_t *view, uint64_t block, uint64_t blocks, char *format, ...)
+{
+  disk_t *disk = view->disk;
+  va_list args;
+
+  if(!disk->regions.enabled || !blocks) return;
+
+  uint64_t start = view->offset + block * view->block_size;
+  uint64_t end = start + blocks * view->block_size;
+
+  // corrupt data
+  if(end < start || blocks > UINT64_MAX / view->block_size) end = UINT64_MAX;
+
+  if(disk->regions.size == disk->regions.max) {
+    disk->regions.max = disk->regions.max ? 2 * disk->regions.max : 256;
+    disk->regions.list = reallocarray(disk->regions.list, disk->regions.max, sizeof *disk->regions.list);
+  }
+
+  region_t *region = disk->regions.list + disk->regions.size++;
+
+  region->first = start >> 9;
+  region->last = end == UINT64_MAX ? UINT64_MAX >> 9 : ((end + 511) >> 9) - 1;
+
+  va_start(args, format);
+  if(vasprintf(&region->name, format, args) == -1) region->name = NULL;
+  va_end(args);
+}
+
+
+void region_free(disk_t *disk)
+{
+  for(unsigned u = 0; u < disk->regions.size; u++) free(disk->regions.list[u].name);
+
+  free(disk->regions.list);
+  disk->regions.list = NULL;
+  disk->regions.size = disk->regions.max = 0;
+}
+
+
+/*
+ * Sort by start block; at the same start, larger regions first.
+ */
+static int region_cmp(const void *a, const void *b)
+{
+  const region_t *r1 = a, *r2 = b;
+
+  if(r1->first != r2->first) return r1->first < r2->first ? -1 : 1;
+  if(r1->last != r2->last) return r1->last > r2->last ? -1 : 1;
+
+  return strcmp(r1->name ?: "", r2->name ?: "");
+}
+
+
+/*
+ * Add all regions in [start, end) that end after last to overlaps.
+ *
+ * tree is a segment tree holding the max. last block of each subtree, over
+ * the regions sorted by start block. So only subtrees that really contain
+ * such regions are visited.
+ */
+static void region_find_overlaps(region_overlaps_t *overlaps, uint64_t *tree, unsigned tree_size, unsigned node, unsigned node_start, unsigned node_end, unsigned start, unsigned end, unsigned outer, uint64_t last)
+{
+  if(end <= node_start || start >= node_end || tree[node] <= last) return;
+
+  if(node >= tree_size) {
+    if(overlaps->size == overlaps->max) {
+      overlaps->max = overlaps->max ? 2 * overlaps->max : 16;
+      overlaps->list = reallocarray(overlaps->list, overlaps->max, sizeof *overlaps->list);
+    }
+    overlaps->list[overlaps->size++] = (region_overlap_t) { .outer = outer, .inner = node - tree_size };
+
+    return;
+  }
+
+  unsigned node_mid = node_start + (node_end - node_start) / 2;
+
+  region_find_overlaps(overlaps, tree, tree_size, 2 * node, node_start, node_mid, start, end, outer, last);
+  region_find_overlaps(overlaps, tree, tree_size, 2 * node + 1, node_mid, node_end, start, end, outer, last);
+}
+
+
+static json_object *region_json(region_t *region)
+{
+  json_object *json = json_object_new_object();
+
+  json_object_object_add(json, "name", json_object_new_string(region->name ?: ""));
+  json_object_object_add(json, "first_lba", json_object_new_int64(region->first));
+  json_object_object_add(json, "last_lba", json_object_new_int64(region->last));
+  json_object_object_add(json, "size", json_object_new_int64(region->last - region->first + 1));
+
+  return json;
+}
+
+
+/*
+ * Print block ownership map: gaps and partially overlapping regions.
+ *
+ * Regions are sorted once; gaps come from a single sweep, overlaps from a
+ * range query per region. So this is O(n log n + overlaps), not O(n^2).
+ */
+void dump_lba_map(disk_t *disk)
+{
+  disk_view_t view = disk_view(disk, 512);
+  region_overlaps_t overlaps = {};
+  unsigned u, n;
+
+  // iso9660 file extents are all in the file index already
+  if(!disk->iso.read) read_isoinfo(disk);
+
+  for(u = 0; u < disk->iso.size; u++) {
+    iso_file_t *file = disk->iso.files + u;
+    region_add(&view, file->start, file->end - file->start, "iso9660 file %s", file->name);
+  }
+
+  region_t *list = disk->regions.list;
+
+  qsort(list, disk->regions.size, sizeof *list, region_cmp);
+
+  // drop duplicates (e.g. file systems seen by several analyzers)
+  for(u = n = 0; u < disk->regions.size; u++) {
+    if(
+      n &&
+      list[n - 1].first == list[u].first &&
+      list[n - 1].last == list[u].last &&
+      !strcmp(list[n - 1].name ?: "", list[u].name ?: "")
+    ) {
+      free(list[u].name);
+      continue;
+    }
+    list[n++] = list[u];
+  }
+  disk->regions.size = n;
+
+  json_object *json_map = json_object_new_object();
+  json_object_object_add(disk->json_disk, "lba_map", json_map);
+
+  log_info(SEP "\nlba map:\n");
+
+  json_object_object_add(json_map, "block_size", json_object_new_int(512));
+  json_object_object_add(json_map, "regions", json_object_new_int64(n));
+  log_info("  block size: 512\n  regions: %u\n", n);
+
+  if(opt.verbose) {
+    json_object *json_list = json_object_new_array();
+    json_object_object_add(json_map, "map", json_list);
+
+    for(u = 0; u < n; u++) {
+      json_object_array_add(json_list, region_json(list + u));
+      log_info(
+        "    %"PRIu64" - %"PRIu64" (size %"PRIu64"): %s\n",
+        list[u].first, list[u].last, list[u].last - list[u].first + 1, list[u].name ?: ""
+      );
+    }
+  }
+
+  // gaps: sweep over start blocks, tracking the end of the covered area
+  uint64_t disk_blocks = (disk->size_in_bytes + 511) >> 9;
+  uint64_t covered = 0;
+  unsigned gaps = 0;
+
+  json_object *json_gaps = json_object_new_array();
+  json_object_object_add(json_map, "gaps", json_gaps);
+
+  for(u = 0; u <= n; u++) {
+    uint64_t next = u < n ? list[u].first : disk_blocks;
+
+    if(next > covered) {
+      if(!gaps++) log_info("  gaps:\n");
+      log_info("    %"PRIu64" - %"PRIu64" (size %"PRIu64")\n", covered, next - 1, next - covered);
+
+      json_object *json_gap = json_object_new_object();
+      json_object_array_add(json_gaps, json_gap);
+      json_object_object_add(json_gap, "first_lba", json_object_new_int64(covered));
+      json_object_object_add(json_gap, "last_lba", json_object_new_int64(next - 1));
+      json_object_object_add(json_gap, "size", json_object_new_int64(next - covered));
+    }
+
+    if(u < n && list[u].last + 1 > covered) covered = list[u].last + 1;
+  }
+
+  if(!gaps) log_info("  gaps: none\n");
+
+  // overlaps: region i partially overlaps region j if it starts inside j
+  // (after j's start) and ends after j's end
+  unsigned tree_size = 1;
+  while(tree_size < n) tree_size <<= 1;
+
+  uint64_t *tree = calloc(2 * tree_size, sizeof *tree);
+
+  for(u = 0; u < n; u++) tree[tree_size + u] = list[u].last;
+  for(u = tree_size - 1; u > 0; u--) tree[u] = tree[2 * u] > tree[2 * u + 1] ? tree[2 * u] : tree[2 * u + 1];
+
+  for(u = 0; u < n; u++) {
+    // regions starting inside list[u]: (u, end)
+    unsigned lo = u + 1, hi = n;
+    while(lo < hi) {
+      unsigned mid = lo + (hi - lo) / 2;
+      if(list[mid].first <= list[u].last) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+
+    // same start block means nested
+    unsigned start = u + 1;
+    while(start < lo && list[start].first == list[u].first) start++;
+
+    region_find_overlaps(&overlaps, tree, tree_size, 1, 0, tree_size, start, lo, u, list[u].last);
+  }
+
+  free(tree);
+
+  json_object *json_overlaps = json_object_new_array();
+  json_object_object_add(json_map, "overlaps", json_overlaps);
+
+  if(overlaps.size) {
+    log_info("  overlaps:\n");
+  }
+  else {
+    log_info("  overlaps: none\n");
+  }
+
+  for(u = 0; u < overlaps.size; u++) {
+    region_t *outer = list + overlaps.list[u].outer;
+    region_t *inner = list + overlaps.list[u].inner;
+
+    log_info(
+      "    %"PRIu64" - %"PRIu64" (size %"PRIu64"):\n"
+      "      %s: %"PRIu64" - %"PRIu64"\n"
+      "      %s: %"PRIu64" - %"PRIu64"\n",
+      inner->first, outer->last, outer->last - inner->first + 1,
+      outer->name ?: "", outer->first, outer->last,
+      inner->name ?: "", inner->first, inner->last
+    );
+
+    json_object *json_overlap = json_object_new_object();
+    json_object_array_add(json_overlaps, json_overlap);
+    json_object_object_add(json_overlap, "first_lba", json_object_new_int64(inner->first));
+    json_object_object_add(json_overlap, "last_lba", json_object_new_int64(outer->last));
+    json_object_object_add(json_overlap, "size", json_object_new_int64(outer->last - inner->first + 1));
+
+    json_object *json_regions = json_object_new_array();
+    json_object_object_add(json_overlap, "regions", json_regions);
+    json_object_array_add(json_regions, region_json(outer));
+    json_object_array_add(json_regions, region_json(inner));
+  }
+
+  free(overlaps.list);
+}
@@ -0,0 +1,10 @@
+// a disk area claimed by some structure (partition, fs, file, table...)
+typedef struct region_s {
+  uint64_t first;		// first block (in 512 byte units)
+  uint64_t last;		// last block
+  char *name;
+} region_t;
+
+void region_add(disk_view_t *view, uint64_t block, uint64_t blocks, char *format, ...) __attribute__ ((format (printf, 4, 5)));
+void region_free(disk_t *disk);
+void dump_lba_map(disk_t *disk);
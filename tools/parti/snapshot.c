@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <zstd.h>
+
+#include "util.h"
+#include "disk.h"
+#include "snapshot.h"
+
+/*
+ * Binary disk snapshot.
+ *
+ * A snapshot file is a sequence of disk sections. All numbers are little
+ * endian. Each section looks like this:
+ *
+ *   header (SNAPSHOT_HEADER_SIZE bytes):
+ *     0  magic "PARTISNP"
+ *     8  format version
+ *    12  header size
+ *    16  disk index
+ *    20  chunk size
+ *    24  disk size in bytes (64 bit)
+ *    32  number of index entries (64 bit)
+ *    40  number of frames
+ *    44  logical block size (0: 512)
+ *    48  section size, including header (64 bit)
+ *    56  reserved (64 bit)
+ *
+ *   chunk index, sorted by chunk number (SNAPSHOT_INDEX_SIZE bytes each):
+ *     0  chunk number (64 bit)
+ *     8  frame number (SNAPSHOT_ZERO_FRAME: chunk is all zeros)
+ *    12  chunk offset in uncompressed frame
+ *
+ *   frame table (SNAPSHOT_FRAME_SIZE bytes each):
+ *     0  frame offset, relative to section start (64 bit)
+ *     8  stored size
+ *    12  uncompressed size
+ *    16  compression (snapshot_compression_t)
+ *    20  reserved
+ *
+ *   frame data
+ *
+ * Frames hold up to SNAPSHOT_FRAME_DATA bytes of chunk data. They are
+ * stored zstd-compressed unless that doesn't make them smaller.
+ */
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t max;
+} buffer_t;
+
+static void put_dword_le(void *buf, unsigned val);
+static void put_qword_le(void *buf, uint64_t val);
+static void *buffer_add(buffer_t *buf, size_t size);
+static void add_frame(buffer_t *frames, buffer_t *payload, uint8_t *data, unsigned size);
+static uint8_t *frame_data(disk_t *disk, unsigned frame);
+
+
+static void put_dword_le(void *buf, unsigned val)
+{
+  unsigned char *b = buf;
+
+  b[0] = val;
+  b[1] = val >> 8;
+  b[2] = val >> 16;
+  b[3] = val >> 24;
+}
+
+
+static void put_qword_le(void *buf, uint64_t val)
+{
+  put_dword_le(buf, val);
+  put_dword_le(buf + 4, val >> 32);
+}
+
+
+/*
+ * Append size zeroed bytes to buffer; return pointer to them.
+ */
+static void *buffer_add(buffer_t *buf, size_t size)
+{
+  if(buf->size + size > buf->max) {
+    buf->max = 2 * (buf->size + size);
+    buf->data = realloc(buf->data, buf->max);
+  }
+
+  void *data = buf->data + buf->size;
+
+  memset(data, 0, size);
+  buf->size += size;
+
+  return data;
+}
+
+
+/*
+ * Add a frame with size bytes of chunk data.
+ *
+ * The frame offset is relative to the payload start here; it's fixed up
+ * when the section is written.
+ */
+static void add_frame(buffer_t *frames, buffer_t *payload, uint8_t *data, unsigned size)
+{
+  uint8_t *frame = buffer_add(frames, SNAPSHOT_FRAME_SIZE);
+  size_t bound = ZSTD_compressBound(size);
+  size_t start = payload->size;
+  uint8_t *dst = buffer_add(payload, bound);
+  size_t len = ZSTD_compress(dst, bound, data, size, SNAPSHOT_ZSTD_LEVEL);
+  snapshot_compression_t compression = snapshot_zstd;
+
+  if(ZSTD_isError(len) || len >= size) {
+    memcpy(dst, data, size);
+    len = size;
+    compression = snapshot_none;
+  }
+
+  payload->size = start + len;
+
+  put_qword_le(frame, start);
+  put_dword_le(frame + 8, len);
+  put_dword_le(frame + 12, size);
+  put_dword_le(frame + 16, compression);
+}
+
+
+/*
+ * Append binary snapshot of cached disk data to file_name.
+ *
+ * file_name "-" means stdout.
+ */
+int snapshot_export(disk_t *disk, char *file_name)
+{
+  buffer_t frames = {}, payload = {};
+  unsigned frame_count = 0;
+  unsigned chunks_per_frame = SNAPSHOT_FRAME_DATA / disk->chunk_size ?: 1;
+  uint8_t *frame = malloc((size_t) chunks_per_frame * disk->chunk_size);
+  unsigned frame_chunks = 0;
+  uint8_t *index = calloc(disk->cache.size ?: 1, SNAPSHOT_INDEX_SIZE);
+  unsigned *order = disk_cache_sorted(disk);
+  uint8_t header[SNAPSHOT_HEADER_SIZE] = {};
+  FILE *f = stdout;
+  int err = 0;
+
+  for(unsigned u = 0; u < disk->cache.size; u++) {
+    disk_data_t *disk_data = disk->cache.list + order[u];
+    uint8_t *entry = index + (size_t) u * SNAPSHOT_INDEX_SIZE;
+    unsigned zero = 1;
+
+    for(unsigned u1 = 0; u1 < disk->chunk_size; u1++) {
+      if(disk_data->data[u1]) {
+        zero = 0;
+        break;
+      }
+    }
+
+    put_qword_le(entry, disk_data->chunk_nr);
+
+    if(zero) {
+      put_dword_le(entry + 8, SNAPSHOT_ZERO_FRAME);
+      continue;
+    }
+
+    put_dword_le(entry + 8, frame_count);
+    put_dword_le(entry + 12, frame_chunks * disk->chunk_size);
+
+    memcpy(frame + (size_t) frame_chunks * disk->chunk_size, disk_data->data, disk->chunk_size);
+
+    if(++frame_chunks == chunks_per_frame) {
+      add_frame(&frames, &payload, frame, frame_chunks * disk->chunk_size);
+      frame_count++;
+      frame_chunks = 0;
+    }
+  }
+
+  if(frame_chunks) {
+    add_frame(&frames, &payload, frame, frame_chunks * disk->chunk_size);
+    frame_count++;
+  }
+
+  size_t index_size = (size_t) disk->cache.size * SNAPSHOT_INDEX_SIZE;
+  uint64_t payload_start = SNAPSHOT_HEADER_SIZE + index_size + frames.size;
+
+  for(unsigned u = 0; u < frame_count; u++) {
+    uint8_t *entry = frames.data + (size_t) u * SNAPSHOT_FRAME_SIZE;
+    put_qword_le(entry, read_qword_le(entry) + payload_start);
+  }
+
+  memcpy(header, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC - 1);
+  put_dword_le(header + 8, SNAPSHOT_VERSION);
+  put_dword_le(header + 12, SNAPSHOT_HEADER_SIZE);
+  put_dword_le(header + 16, disk->index);
+  put_dword_le(header + 20, disk->chunk_size);
+  put_qword_le(header + 24, disk->size_in_bytes);
+  put_qword_le(header + 32, disk->cache.size);
+  put_dword_le(header + 40, frame_count);
+  put_dword_le(header + 44, disk->sector_size);
+  put_qword_le(header + 48, payload_start + payload.size);
+
+  if(strcmp(file_name, "-")) {
+    f = fopen(file_name, "a");
+    if(!f) {
+      perror(file_name);
+      err = 1;
+    }
+  }
+
+  if(
+    !err && (
+      fwrite(header, sizeof header, 1, f) != 1 ||
+      (index_size && fwrite(index, index_size, 1, f) != 1) ||
+      (frames.size && fwrite(frames.data, frames.size, 1, f) != 1) ||
+      (payload.size && fwrite(payload.data, payload.size, 1, f) != 1) ||
+      fflush(f)
+    )
+  ) {
+    perror(file_name);
+    err = 1;
+  }
+
+  if(f && f != stdout) fclose(f);
+
+  free(frame);
+  free(index);
+  free(frames.data);
+  free(payload.data);
+
+  return err;
+}
+
+
+/*
+ * Import binary snapshot file_name.
+ *
+ * map holds the file content (size bytes) and must stay valid; chunks are
+ * looked up on first access (see snapshot_chunk()).
+ *
+ * Returns 0 if the file is not a binary snapshot, else 1.
+ */
+int snapshot_import(char *file_name, uint8_t *map, uint64_t size)
+{
+  if(size < sizeof SNAPSHOT_MAGIC - 1 || memcmp(map, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC - 1)) return 0;
+
+  for(uint64_t pos = 0; pos < size;) {
+    uint8_t *section = map + pos;
+    uint64_t avail = size - pos;
+    char *error = NULL;
+
+    if(avail < SNAPSHOT_HEADER_SIZE || memcmp(section, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC - 1)) {
+      error = "invalid section header";
+    }
+    else if(read_dword_le(section + 8) != SNAPSHOT_VERSION) {
+      error = "unsupported format version";
+    }
+
+    unsigned header_size = error ? 0 : read_dword_le(section + 12);
+    unsigned chunk_size = error ? 0 : read_dword_le(section + 20);
+    unsigned sector_size = error ? 0 : read_dword_le(section + 44) ?: 512;
+    uint64_t chunks = error ? 0 : read_qword_le(section + 32);
+    unsigned frame_count = error ? 0 : read_dword_le(section + 40);
+    uint64_t section_size = error ? 0 : read_qword_le(section + 48);
+
+    if(
+      !error && (
+        header_size < SNAPSHOT_HEADER_SIZE ||
+        sector_size < 512 || (sector_size & (sector_size - 1)) ||
+        chunk_size < sector_size || chunk_size > DISK_MAX_CHUNK_SIZE || (chunk_size & (chunk_size - 1)) ||
+        section_size > avail ||
+        chunks > section_size / SNAPSHOT_INDEX_SIZE ||
+        frame_count > section_size / SNAPSHOT_FRAME_SIZE ||
+        header_size + chunks * SNAPSHOT_INDEX_SIZE + (uint64_t) frame_count * SNAPSHOT_FRAME_SIZE > section_size
+      )
+    ) {
+      error = "invalid section size";
+    }
+
+    snapshot_t *snapshot = calloc(1, sizeof *snapshot);
+
+    snapshot->section = section;
+    snapshot->index = section + header_size;
+    snapshot->chunks = chunks;
+    snapshot->frames = snapshot->index + chunks * SNAPSHOT_INDEX_SIZE;
+    snapshot->frame_count = frame_count;
+
+    for(unsigned u = 0; !error && u < frame_count; u++) {
+      uint8_t *frame = snapshot->frames + (size_t) u * SNAPSHOT_FRAME_SIZE;
+      uint64_t offset = read_qword_le(frame);
+      unsigned stored = read_dword_le(frame + 8);
+      unsigned size = read_dword_le(frame + 12);
+      unsigned compression = read_dword_le(frame + 16);
+      if(
+        offset > section_size || stored > section_size - offset ||
+        (compression == snapshot_none && stored != size) ||
+        compression > snapshot_zstd
+      ) {
+        error = "invalid frame table";
+      }
+    }
+
+    for(uint64_t u = 0; !error && u < chunks; u++) {
+      uint8_t *entry = snapshot->index + u * SNAPSHOT_INDEX_SIZE;
+      unsigned frame = read_dword_le(entry + 8);
+      unsigned offset = read_dword_le(entry + 12);
+      if(u && read_qword_le(entry) <= read_qword_le(entry - SNAPSHOT_INDEX_SIZE)) {
+        error = "chunk index not sorted";
+      }
+      else if(
+        frame != SNAPSHOT_ZERO_FRAME && (
+          frame >= frame_count ||
+          (uint64_t) offset + chunk_size > read_dword_le(snapshot->frames + (size_t) frame * SNAPSHOT_FRAME_SIZE + 12)
+        )
+      ) {
+        error = "invalid chunk index";
+      }
+    }
+
+    if(error) {
+      fprintf(stderr, "%s: offset %"PRIu64": %s\n", file_name, pos, error);
+      exit(1);
+    }
+
+    snapshot->frame_data = calloc(frame_count ?: 1, sizeof *snapshot->frame_data);
+    snapshot->zero_chunk = calloc(1, chunk_size);
+
+    disk_t disk = {
+      .fd = -1,
+      .index = disk_list_size,
+      .size_in_bytes = read_qword_le(section + 24),
+      .chunk_size = chunk_size,
+      .sector_size = sector_size,
+      .snapshot = snapshot
+    };
+
+    asprintf(&disk.name, "%s#%u", file_name, read_dword_le(section + 16));
+
+    disk_add_to_list(&disk);
+
+    pos += section_size;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Get uncompressed data of frame.
+ *
+ * Uncompressed frames are used directly from the file mapping, compressed
+ * ones are decompressed on first use and kept.
+ */
+static uint8_t *frame_data(disk_t *disk, unsigned frame)
+{
+  snapshot_t *snapshot = disk->snapshot;
+  uint8_t *entry = snapshot->frames + (size_t) frame * SNAPSHOT_FRAME_SIZE;
+  uint8_t *data = snapshot->section + read_qword_le(entry);
+  unsigned stored = read_dword_le(entry + 8);
+  unsigned size = read_dword_le(entry + 12);
+
+  if(read_dword_le(entry + 16) == snapshot_none) return data;
+
+  if(!snapshot->frame_data[frame]) {
+    uint8_t *buf = malloc(size);
+    size_t len = ZSTD_decompress(buf, size, data, stored);
+
+    if(ZSTD_isError(len) || len != size) {
+      fprintf(stderr, "%s: frame %u: decompression failed\n", disk->name, frame);
+      exit(1);
+    }
+
+    snapshot->frame_data[frame] = buf;
+  }
+
+  return snapshot->frame_data[frame];
+}
+
+
+/*
+ * Get data of chunk chunk_nr from snapshot.
+ *
+ * The returned pointer stays valid as long as the disk exists.
+ *
+ * Returns NULL if the chunk is not in the snapshot.
+ */
+uint8_t *snapshot_chunk(disk_t *disk, uint64_t chunk_nr)
+{
+  snapshot_t *snapshot = disk->snapshot;
+  uint64_t lo = 0, hi = snapshot->chunks;
+
+  while(lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint8_t *entry = snapshot->index + mid * SNAPSHOT_INDEX_SIZE;
+    uint64_t nr = read_qword_le(entry);
+
+    if(nr == chunk_nr) {
+      unsigned frame = read_dword_le(entry + 8);
+
+      if(frame == SNAPSHOT_ZERO_FRAME) return snapshot->zero_chunk;
+
+      return frame_data(disk, frame) + read_dword_le(entry + 12);
+    }
+
+    if(nr < chunk_nr) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+
+void snapshot_free(disk_t *disk)
+{
+  snapshot_t *snapshot = disk->snapshot;
+
+  if(!snapshot) return;
+
+  // only decompressed frames are ours, see frame_data()
+  for(unsigned u = 0; u < snapshot->frame_count; u++) free(snapshot->frame_data[u]);
+  free(snapshot->frame_data);
+  free(snapshot->zero_chunk);
+
+  free(snapshot);
+  disk->snapshot = NULL;
+}
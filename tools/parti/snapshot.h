@@ -0,0 +1,30 @@
+#define SNAPSHOT_MAGIC		"PARTISNP"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_HEADER_SIZE	64
+#define SNAPSHOT_INDEX_SIZE	16
+#define SNAPSHOT_FRAME_SIZE	24
+
+// uncompressed size of a payload frame
+#define SNAPSHOT_FRAME_DATA	(64 * 1024)
+
+#define SNAPSHOT_ZSTD_LEVEL	9
+
+// frame number in index entries for all-zero chunks
+#define SNAPSHOT_ZERO_FRAME	0xffffffff
+
+typedef enum { snapshot_none, snapshot_zstd } snapshot_compression_t;
+
+typedef struct snapshot_s {
+  uint8_t *section;		// start of disk section in file mapping
+  uint8_t *index;		// chunk index, sorted by chunk number
+  uint64_t chunks;		// index entries
+  uint8_t *frames;		// frame table
+  unsigned frame_count;		// frame table entries
+  uint8_t **frame_data;		// decompressed frames (or NULL)
+  uint8_t *zero_chunk;		// all-zero chunk
+} snapshot_t;
+
+int snapshot_export(disk_t *disk, char *file_name);
+int snapshot_import(char *file_name, uint8_t *map, uint64_t size);
+uint8_t *snapshot_chunk(disk_t *disk, uint64_t chunk_nr);
+void snapshot_free(disk_t *disk);
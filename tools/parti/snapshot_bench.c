@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+
+/*
+ * Text snapshot round trip benchmark.
+ *
+ * Usage: snapshot_bench [MiB]
+ *
+ * Caches MiB (default 32) of random data in 1 MiB runs spread over a
+ * 4.7 GB disk - more than a full install DVD's metadata -, exports it as
+ * hex dump, imports it again and compares the result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "json.h"
+#include "disk.h"
+
+#define DISK_SIZE	4700000000ull
+#define RUN_SIZE	(1 << 20)
+
+static double now(void);
+
+
+int main(int argc, char **argv)
+{
+  unsigned runs = argc > 1 ? strtoul(argv[1], NULL, 0) : 32;
+  disk_t disk = { .chunk_size = 512, .sector_size = 512, .fd = -1, .size_in_bytes = DISK_SIZE };
+  unsigned chunks_per_run = RUN_SIZE / disk.chunk_size;
+  uint64_t run_dist = DISK_SIZE / disk.chunk_size / (runs ?: 1);
+  char file_name[] = "/tmp/snapshot_bench.XXXXXX";
+  uint8_t buf[512], buf2[512];
+  struct stat sbuf;
+  unsigned diffs = 0;
+  double t;
+
+  json_init();
+
+  // no disk summary from disk_import()
+  opt.json = 1;
+
+  int fd = mkstemp(file_name);
+
+  if(fd == -1) {
+    perror(file_name);
+    return 1;
+  }
+  close(fd);
+
+  srandom(1);
+  for(unsigned u = 0; u < runs; u++) {
+    for(unsigned c = 0; c < chunks_per_run; c++) {
+      for(unsigned i = 0; i < sizeof buf; i++) buf[i] = random();
+      disk_cache_store(&disk, buf, u * run_dist + c);
+    }
+  }
+
+  t = now();
+  disk_export(&disk, file_name, 1);
+  t = now() - t;
+
+  stat(file_name, &sbuf);
+
+  printf("%u MiB cached data, %.0f MB text\n", runs, sbuf.st_size / 1e6);
+  printf("  export:  %6.3f s  %5.0f MB/s\n", t, sbuf.st_size / t / 1e6);
+
+  t = now();
+  disk_import(file_name);
+  t = now() - t;
+
+  printf("  import:  %6.3f s  %5.0f MB/s\n", t, sbuf.st_size / t / 1e6);
+
+  unlink(file_name);
+
+  if(disk_list_size != 1 || disk_list[0].cache.size != disk.cache.size) {
+    fprintf(stderr, "round trip failed: wrong number of chunks\n");
+    return 1;
+  }
+
+  for(unsigned u = 0; u < disk.cache.size; u++) {
+    uint64_t chunk_nr = disk.cache.list[u].chunk_nr;
+    if(
+      !disk_cache_read(&disk, buf, chunk_nr) ||
+      !disk_cache_read(disk_list, buf2, chunk_nr) ||
+      memcmp(buf, buf2, sizeof buf)
+    ) diffs++;
+  }
+
+  if(diffs) {
+    fprintf(stderr, "round trip failed: %u chunks differ\n", diffs);
+    return 1;
+  }
+
+  json_done();
+
+  return 0;
+}
+
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "util.h"
+#include "disk.h"
+#include "url.h"
+
+/*
+ * Disk images on a web server, read with HTTP range requests.
+ *
+ * Cache misses go through url_read(): all chunks missing in a read request
+ * are gathered into runs, each run extended to at least URL_READAHEAD, and
+ * runs less than URL_MERGE_GAP apart merged. The resulting requests are
+ * split at URL_REQUEST_MAX and run in parallel (up to URL_PARALLEL). All
+ * data fetched go into the disk cache, so --export-disk sees them.
+ */
+
+typedef struct {
+  uint64_t offset;		// disk offset
+  size_t len;			// requested bytes
+  uint8_t *buf;			// data
+  size_t pos;			// bytes received so far
+  long status;			// HTTP status
+  CURL *curl;			// handle doing the transfer
+} url_range_t;
+
+typedef struct {
+  url_range_t *list;
+  unsigned size;
+  unsigned max;
+} url_ranges_t;
+
+static pthread_once_t url_init_once = PTHREAD_ONCE_INIT;
+
+static void url_init(void);
+static size_t url_write(char *data, size_t size, size_t nmemb, void *range_ptr);
+static size_t url_header(char *data, size_t size, size_t nmemb, void *total_ptr);
+static void url_ranges_add(url_ranges_t *ranges, disk_t *disk, uint64_t offset, uint64_t len, uint8_t *buf);
+static int url_fetch(disk_t *disk, url_range_t *ranges, unsigned count);
+
+
+static void url_init()
+{
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+
+/*
+ * Store received data in range.
+ *
+ * A server ignoring the Range header would send the whole image - don't
+ * accept that (unless it's what we asked for anyway).
+ */
+static size_t url_write(char *data, size_t size, size_t nmemb, void *range_ptr)
+{
+  url_range_t *range = range_ptr;
+  size_t len = size * nmemb;
+
+  curl_easy_getinfo(range->curl, CURLINFO_RESPONSE_CODE, &range->status);
+
+  if(range->status != 206 && !(range->status == 200 && range->offset == 0)) return 0;
+
+  if(len > range->len - range->pos) return 0;
+
+  memcpy(range->buf + range->pos, data, len);
+  range->pos += len;
+
+  return len;
+}
+
+
+/*
+ * Get image size from 'Content-Range: bytes 0-0/SIZE' header.
+ */
+static size_t url_header(char *data, size_t size, size_t nmemb, void *total_ptr)
+{
+  size_t len = size * nmemb;
+  char buf[128];
+
+  if(len < sizeof buf && !strncasecmp(data, "content-range:", sizeof "content-range:" - 1)) {
+    char *s;
+
+    memcpy(buf, data, len);
+    buf[len] = 0;
+
+    if((s = strchr(buf, '/'))) *(uint64_t *) total_ptr = strtoull(s + 1, NULL, 10);
+  }
+
+  return len;
+}
+
+
+/*
+ * Set up disk->url for disk->name (an http or https URL).
+ *
+ * A first range request checks that the server can handle them and gets
+ * the image size.
+ *
+ * Returns 0 on success, else an errno value.
+ */
+int url_open(disk_t *disk)
+{
+  pthread_once(&url_init_once, url_init);
+
+  url_t *url = disk->url = calloc(1, sizeof *disk->url);
+
+  if(!url) return ENOMEM;
+
+  url->multi = curl_multi_init();
+
+  if(!url->multi) {
+    url_free(disk);
+    return ENOMEM;
+  }
+
+  for(unsigned u = 0; u < URL_PARALLEL; u++) {
+    CURL *curl = url->handles[u] = curl_easy_init();
+
+    if(!curl) {
+      url_free(disk);
+      return ENOMEM;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, disk->name);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "parti/" VERSION);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, url_write);
+  }
+
+  uint8_t byte;
+  uint64_t total = 0;
+  CURL *curl = url->handles[0];
+  url_range_t range = { .len = 1, .buf = &byte, .curl = curl };
+
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, url_header);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &total);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &range);
+  curl_easy_setopt(curl, CURLOPT_RANGE, "0-0");
+
+  CURLcode res = curl_easy_perform(curl);
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &range.status);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+
+  url->requests++;
+  disk->stats.read_calls++;
+
+  int err = 0;
+
+  if(res == CURLE_HTTP_RETURNED_ERROR) {
+    err = range.status == 404 ? ENOENT : range.status == 401 || range.status == 403 ? EACCES : EIO;
+  }
+  else if(res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+    err = EIO;
+  }
+  else if(range.status != 206 || !total) {
+    // no range support
+    err = EOPNOTSUPP;
+  }
+
+  if(err) {
+    url_free(disk);
+    return err;
+  }
+
+  disk->size_in_bytes = total;
+
+  return 0;
+}
+
+
+/*
+ * Read count chunks starting at chunk_nr, using the cache.
+ *
+ * All misses are fetched at once, see the comment at the top.
+ */
+int url_read(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count)
+{
+  unsigned chunk_size = disk->chunk_size;
+  uint64_t disk_chunks = (disk->size_in_bytes + chunk_size - 1) / chunk_size;
+  uint64_t readahead = URL_READAHEAD / chunk_size ?: 1;
+  uint64_t gap = URL_MERGE_GAP / chunk_size;
+  uint64_t run_start = 0, run_end = 0, chunk;
+  url_ranges_t ranges = {};
+  unsigned u;
+  int err = 0;
+
+  for(u = 0; u < count; u++) {
+    chunk = chunk_nr + u;
+
+    if(disk_cache_lookup(disk, chunk)) {
+      disk->stats.cache_hits++;
+      continue;
+    }
+
+    disk->stats.cache_misses++;
+
+    // already part of current run
+    if(chunk < run_end || chunk >= disk_chunks) continue;
+
+    // extend to readahead size or end of request, whichever is larger
+    uint64_t end = chunk + 1;
+    uint64_t limit = chunk + readahead > chunk_nr + count ? chunk + readahead : chunk_nr + count;
+    if(limit > disk_chunks) limit = disk_chunks;
+    while(end < limit && !disk_cache_lookup(disk, end)) end++;
+
+    if(run_end && chunk - run_end <= gap) {
+      disk->url->merged++;
+      run_end = end;
+      continue;
+    }
+
+    if(run_end) url_ranges_add(&ranges, disk, run_start * chunk_size, (run_end - run_start) * chunk_size, NULL);
+
+    run_start = chunk;
+    run_end = end;
+  }
+
+  if(run_end) url_ranges_add(&ranges, disk, run_start * chunk_size, (run_end - run_start) * chunk_size, NULL);
+
+  if(ranges.size) err = url_fetch(disk, ranges.list, ranges.size);
+
+  // cache everything we got; a partial chunk only at the end of the image
+  for(u = 0; u < ranges.size; u++) {
+    url_range_t *range = ranges.list + u;
+    uint64_t first = range->offset / chunk_size;
+    uint64_t chunks = range->pos == range->len ? (range->len + chunk_size - 1) / chunk_size : range->pos / chunk_size;
+
+    for(uint64_t c = 0; c < chunks; c++) {
+      if(disk_cache_lookup(disk, first + c)) continue;
+
+      if((c + 1) * chunk_size <= range->pos) {
+        disk_cache_store(disk, range->buf + c * chunk_size, first + c);
+      }
+      else {
+        // last chunk of image may be incomplete
+        uint8_t tmp[DISK_MAX_CHUNK_SIZE];
+        memset(tmp, 0, chunk_size);
+        memcpy(tmp, range->buf + c * chunk_size, range->pos - c * chunk_size);
+        disk_cache_store(disk, tmp, first + c);
+      }
+    }
+
+    free(range->buf);
+  }
+
+  free(ranges.list);
+
+  for(u = 0; u < count; u++, buffer += chunk_size) {
+    if(!disk_cache_read(disk, buffer, chunk_nr + u)) {
+      fprintf(stderr, "error reading sector %"PRIu64"\n", chunk_nr + u);
+
+      return 3;
+    }
+  }
+
+  return err;
+}
+
+
+/*
+ * Read len bytes at offset, without cache.
+ *
+ * Returns the number of bytes read (less than len on error or at the end
+ * of the image).
+ */
+size_t url_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset)
+{
+  url_t *url = disk->url;
+  url_ranges_t ranges = {};
+  size_t pos = 0;
+  unsigned u;
+
+  if(offset >= disk->size_in_bytes) return 0;
+  if(len > disk->size_in_bytes - offset) len = disk->size_in_bytes - offset;
+
+  // continues the last read: fetch ahead, in parallel
+  if(offset == url->stream.next && offset && len <= URL_STREAM_SIZE) {
+    url->stream.next = offset + len;
+
+    if(offset < url->stream.offset || offset + len > url->stream.offset + url->stream.len) {
+      if(!url->stream.buf) url->stream.buf = malloc(URL_STREAM_SIZE);
+
+      url->stream.offset = offset;
+      url->stream.len = 0;
+
+      url_ranges_add(&ranges, disk, offset, URL_STREAM_SIZE, url->stream.buf);
+      url_fetch(disk, ranges.list, ranges.size);
+
+      for(u = 0; u < ranges.size && url->stream.len == ranges.list[u].offset - offset; u++) {
+        url->stream.len += ranges.list[u].pos;
+      }
+
+      free(ranges.list);
+    }
+
+    pos = url->stream.offset + url->stream.len - offset;
+    if(pos > len) pos = len;
+
+    memcpy(buffer, url->stream.buf + (offset - url->stream.offset), pos);
+
+    return pos;
+  }
+
+  url->stream.next = offset + len;
+
+  url_ranges_add(&ranges, disk, offset, len, buffer);
+
+  url_fetch(disk, ranges.list, ranges.size);
+
+  for(u = 0; u < ranges.size && pos == ranges.list[u].offset - offset; u++) {
+    pos += ranges.list[u].pos;
+  }
+
+  free(ranges.list);
+
+  return pos;
+}
+
+
+void url_free(disk_t *disk)
+{
+  url_t *url = disk->url;
+
+  if(!url) return;
+
+  for(unsigned u = 0; u < URL_PARALLEL; u++) {
+    if(url->handles[u]) curl_easy_cleanup(url->handles[u]);
+  }
+  if(url->multi) curl_multi_cleanup(url->multi);
+
+  free(url->stream.buf);
+  free(url);
+  disk->url = NULL;
+}
+
+
+/*
+ * Add len bytes at offset to ranges, split into pieces of at most
+ * URL_REQUEST_MAX; clipped at the end of the image.
+ *
+ * The data go to buf if set, else to a newly allocated buffer.
+ */
+static void url_ranges_add(url_ranges_t *ranges, disk_t *disk, uint64_t offset, uint64_t len, uint8_t *buf)
+{
+  if(offset >= disk->size_in_bytes) return;
+  if(len > disk->size_in_bytes - offset) len = disk->size_in_bytes - offset;
+
+  while(len) {
+    if(ranges->size == ranges->max) {
+      ranges->max = ranges->max ? 2 * ranges->max : 16;
+      ranges->list = reallocarray(ranges->list, ranges->max, sizeof *ranges->list);
+    }
+
+    size_t size = len > URL_REQUEST_MAX ? URL_REQUEST_MAX : len;
+
+    ranges->list[ranges->size++] = (url_range_t) {
+      .offset = offset,
+      .len = size,
+      .buf = buf ?: malloc(size)
+    };
+
+    offset += size;
+    len -= size;
+    if(buf) buf += size;
+  }
+}
+
+
+/*
+ * Fetch all ranges, up to URL_PARALLEL at the same time.
+ *
+ * Returns 0 if all ranges are complete, else 3.
+ */
+static int url_fetch(disk_t *disk, url_range_t *ranges, unsigned count)
+{
+  url_t *url = disk->url;
+  url_range_t *active[URL_PARALLEL] = {};
+  unsigned next = 0, running = 0, u;
+  int err = 0;
+
+  while(next < count || running) {
+    for(u = 0; u < URL_PARALLEL && next < count; u++) {
+      if(active[u]) continue;
+
+      url_range_t *range = active[u] = ranges + next++;
+      char range_str[64];
+
+      range->curl = url->handles[u];
+      snprintf(range_str, sizeof range_str, "%"PRIu64"-%"PRIu64, range->offset, range->offset + range->len - 1);
+
+      curl_easy_setopt(url->handles[u], CURLOPT_RANGE, range_str);
+      curl_easy_setopt(url->handles[u], CURLOPT_WRITEDATA, range);
+      curl_multi_add_handle(url->multi, url->handles[u]);
+
+      url->requests++;
+      disk->stats.read_calls++;
+      if(++running > url->parallel_max) url->parallel_max = running;
+    }
+
+    int still_running, msgs;
+    CURLMsg *msg;
+
+    curl_multi_perform(url->multi, &still_running);
+
+    while((msg = curl_multi_info_read(url->multi, &msgs))) {
+      if(msg->msg != CURLMSG_DONE) continue;
+
+      for(u = 0; u < URL_PARALLEL && url->handles[u] != msg->easy_handle; u++);
+      if(u == URL_PARALLEL || !active[u]) continue;
+
+      url_range_t *range = active[u];
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &range->status);
+
+      if(msg->data.result != CURLE_OK || range->pos != range->len) {
+        fprintf(stderr,
+          "%s: error reading bytes %"PRIu64" - %"PRIu64": %s (HTTP status %ld)\n",
+          disk->name, range->offset, range->offset + range->len - 1,
+          curl_easy_strerror(msg->data.result), range->status
+        );
+        err = 3;
+      }
+
+      disk->stats.bytes_read += range->pos;
+
+      curl_multi_remove_handle(url->multi, msg->easy_handle);
+      active[u] = NULL;
+      running--;
+    }
+
+    if(running) curl_multi_poll(url->multi, NULL, 0, 1000, NULL);
+  }
+
+  return err;
+}
@@ -0,0 +1,33 @@
+// cache misses closer than this are fetched in a single request
+#define URL_MERGE_GAP		(32 << 10)
+
+// min. request size; a round trip costs more than a few extra KB
+#define URL_READAHEAD		(64 << 10)
+
+// larger requests are split and fetched in parallel
+#define URL_REQUEST_MAX		(1 << 20)
+
+// max. requests in flight per disk
+#define URL_PARALLEL		8
+
+// read-ahead for sequential uncached reads (disk_read_nocache())
+#define URL_STREAM_SIZE		(4 << 20)
+
+typedef struct url_s {
+  void *multi;			// CURLM
+  void *handles[URL_PARALLEL];	// CURL easy handles, reused to keep connections alive
+  uint64_t requests;		// HTTP range requests
+  uint64_t merged;		// cache misses merged into another request
+  unsigned parallel_max;	// max. requests in flight at the same time
+  struct {
+    uint8_t *buf;		// URL_STREAM_SIZE bytes
+    uint64_t offset;		// disk offset of buf
+    size_t len;			// valid bytes in buf
+    uint64_t next;		// where the next sequential read would start
+  } stream;
+} url_t;
+
+int url_open(disk_t *disk);
+int url_read(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned count);
+size_t url_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset);
+void url_free(disk_t *disk);
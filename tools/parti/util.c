@@ -11,10 +11,16 @@
 
 opt_t opt;
 
+// log_info() output goes here; NULL means stdout
+__thread FILE *log_file;
+
+// suppress log_info() output, see parti_analyze()
+__thread unsigned log_off;
+
 
 char *cname(void *buf, int len)
 {
-  static char name[1024];
+  static __thread char name[1024];
   int i;
   char *n;
 
@@ -90,10 +96,10 @@ uint64_t read_qword_be(void *buf)
 
 void log_info(const char *format, ...)
 {
-  if(opt.json) return;
+  if(opt.json || log_off) return;
 
   va_list args;
   va_start(args, format);
-  vfprintf(stdout, format, args);
+  vfprintf(log_file ?: stdout, format, args);
   va_end(args);
 }
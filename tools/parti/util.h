@@ -18,7 +18,14 @@ typedef struct {
     unsigned raw:1;
   } show;
   char *export_file;
+  unsigned export_text:1;
   unsigned json:1;
+  unsigned stats:1;
+  unsigned direct:1;
+  unsigned jobs;
+  char **fs_types;		// fs types to probe for (NULL-terminated), NULL = all
 } opt_t;
 
 extern opt_t opt;
+extern __thread FILE *log_file;
+extern __thread unsigned log_off;
@@ -15,6 +15,7 @@
 #include "disk.h"
 #include "filesystem.h"
 #include "util.h"
+#include "region.h"
 #include "zipl.h"
 
 #define ZIPL_MAGIC      "zIPL"
@@ -22,18 +23,17 @@
 #define ZIPL_PSW_LOAD   0x0008000080000000ll
 
 
-void dump_zipl_components(disk_t *disk, uint64_t sec)
+void dump_zipl_components(disk_view_t *view, uint64_t sec)
 {
-  unsigned char buf[disk->block_size];
-  unsigned char buf2[disk->block_size];
-  unsigned char buf3[disk->block_size];
+  unsigned char buf[view->block_size];
+  unsigned char buf2[view->block_size];
+  unsigned char buf3[view->block_size];
   int i, k;
   uint64_t start, load, start2;
   unsigned size, type, size2, len2;
-  char *s;
   zipl_stage3_head_t zh = {};
 
-  i = disk_read(disk, buf, sec, 1);
+  i = disk_view_read(view, buf, sec, 1);
 
   // compare including terminating 0 (header type 0 = ZIPL_COMP_HEADER_IPL)
   if(i || memcmp(buf, ZIPL_MAGIC, sizeof ZIPL_MAGIC)) {
@@ -41,14 +41,16 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
     return;
   }
 
-  for(i = 1; i < disk->block_size/32; i++) {
+  region_add(view, sec, 1, "zipl component table");
+
+  for(i = 1; i < view->block_size/32; i++) {
     start = read_qword_be(buf + i * 0x20);
     size = read_word_be(buf + i * 0x20 + 8);
     type = read_byte(buf + i * 0x20 + 0x17);
     load = read_qword_be(buf + i * 0x20 + 0x18);
     if(!load) break;
     log_info("       %u start %llu", i - 1, (unsigned long long) start);
-    if((size != disk->block_size && type == 2) || opt.show.raw) log_info(", blksize %d", size);
+    if((size != view->block_size && type == 2) || opt.show.raw) log_info(", blksize %d", size);
     log_info(
       ", addr 0x%016llx, type %d%s\n",
       (unsigned long long) load,
@@ -56,21 +58,37 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
       type == 1 ? " (exec)" : type == 2 ? " (load)" : ""
     );
     if(type == 2) {
-      k = disk_read(disk, buf2, start, 1);
+      k = disk_view_read(view, buf2, start, 1);
       if(!k) {
-        for(k = 0; k < disk->block_size/32; k++) {
+        region_add(view, start, 1, "zipl block list");
+
+        unsigned entries, blocks[view->block_size/32];
+        iso_file_t *files[view->block_size/32];
+
+        // look up all file names at once
+        for(entries = 0; entries < view->block_size/32; entries++) {
+          start2 = read_qword_be(buf2 + entries * 0x10);
+          if(!start2) break;
+          blocks[entries] = start2;
+        }
+
+        iso_blocks_to_files(view->disk, entries, blocks, files);
+
+        for(k = 0; k < entries; k++) {
           start2 = read_qword_be(buf2 + k * 0x10);
           size2 = read_word_be(buf2 + k * 0x10 + 8);
           len2 = read_word_be(buf2 + k * 0x10 + 10) + 1;
-          if(!start2) break;
+          region_add(view, start2, ((uint64_t) len2 * size2 + view->block_size - 1) / view->block_size, "zipl component data");
           log_info(
             "         => start %llu, size %u",
             (unsigned long long) start2,
             len2
           );
-          if(size2 != disk->block_size || opt.show.raw) log_info(", blksize %d", size2);
-          if((s = iso_block_to_name(disk, start2, NULL))) {
-            log_info(", \"%s\"", s);
+          if(size2 != view->block_size || opt.show.raw) log_info(", blksize %d", size2);
+          if(files[k]) {
+            log_info(", \"%s", files[k]->name);
+            if(blocks[k] != files[k]->start) log_info("<+%u>", blocks[k] - files[k]->start);
+            log_info("\"");
           }
           log_info("\n");
         }
@@ -79,7 +97,7 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
         start2 = read_qword_be(buf2);
 
         if(start2) {
-          if(load == 0xa000 && !disk_read(disk, buf3, start2, 1)) {
+          if(load == 0xa000 && !disk_view_read(view, buf3, start2, 1)) {
             zh.parm_addr = read_qword_be(buf3);
             zh.initrd_addr = read_qword_be(buf3 + 8);
             zh.initrd_len = read_qword_be(buf3 + 0x10);
@@ -110,7 +128,7 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
 
           if(load == zh.parm_addr ) {
             log_info("         <parm>\n");
-            if(!disk_read(disk, buf3, start2, 1)) {
+            if(!disk_view_read(view, buf3, start2, 1)) {
               unsigned char *s = buf3;
               buf3[sizeof buf3 - 1] = 0;
               log_info("            \"");
@@ -145,23 +163,27 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
 }
 
 
-void dump_zipl(disk_t *disk)
+void dump_zipl(disk_view_t *disk_view)
 {
+  disk_view_t zipl_view = disk_view_sub(disk_view, 0, 0x200);
+  disk_view_t *view = &zipl_view;
   int i;
-  unsigned char buf[disk->block_size = 0x200];
+  unsigned char buf[view->block_size];
   uint64_t pt_sec, sec;
   unsigned size;
   char *s;
 
-  i = disk_read(disk, buf, 0, 1);
+  i = disk_view_read(view, buf, 0, 1);
 
   if(i || memcmp(buf, ZIPL_MAGIC, sizeof ZIPL_MAGIC - 1)) return;
 
+  region_add(view, 0, 1, "zipl boot record");
+
   log_info(SEP "\nzIPL (SCSI scheme):\n");
 
   log_info(
     "  sector size: %d\n  version: %u\n",
-    disk->block_size,
+    view->block_size,
     read_dword_be(buf + 4)
   );
 
@@ -169,26 +191,28 @@ void dump_zipl(disk_t *disk)
   size = read_word_be(buf + 0x18);
 
   log_info("  program table: %llu", (unsigned long long) pt_sec);
-  if(size != disk->block_size || opt.show.raw) log_info(", blksize %u", size);
-  if((s = iso_block_to_name(disk, pt_sec, NULL))) {
+  if(size != view->block_size || opt.show.raw) log_info(", blksize %u", size);
+  if((s = iso_block_to_name(view->disk, pt_sec, NULL))) {
     log_info(", \"%s\"", s);
   }
   log_info("\n");
 
-  i = disk_read(disk, buf, pt_sec, 1);
+  i = disk_view_read(view, buf, pt_sec, 1);
 
   if(i || memcmp(buf, ZIPL_MAGIC, sizeof ZIPL_MAGIC - 1)) {
     log_info("  invalid program table\n");
     return;
   }
 
-  for(i = 1; i < disk->block_size/16; i++) {
+  region_add(view, pt_sec, 1, "zipl program table");
+
+  for(i = 1; i < view->block_size/16; i++) {
     sec = read_qword_be(buf + i * 0x10);
     size = read_word_be(buf + i * 0x10 + 8);
     if(!sec) break;
     log_info("  %-3d  start %llu", i - 1, (unsigned long long) sec);
-    if(size != disk->block_size || opt.show.raw) log_info(", blksize %u", size);
+    if(size != view->block_size || opt.show.raw) log_info(", blksize %u", size);
     log_info(", components:\n");
-    dump_zipl_components(disk, sec);
+    dump_zipl_components(view, sec);
   }
 }
@@ -10,5 +10,5 @@ typedef struct {
 } zipl_stage3_head_t;
 
 
-void dump_zipl_components(disk_t *disk, uint64_t sec);
-void dump_zipl(disk_t *disk);
+void dump_zipl_components(disk_view_t *view, uint64_t sec);
+void dump_zipl(disk_view_t *view);